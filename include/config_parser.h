@@ -27,6 +27,7 @@
 #define MAX_URIS          300
 #define MAX_HEADERS       150
 #define MAX_HEADER_VALUES 60
+#define MAX_BODY_SIZE     24576
 
 /* Header 结构：一个 header 名可以对应多个值 */
 struct http_header {
@@ -66,4 +67,7 @@ int fh_config_generate_payload(struct http_config *config, uint8_t *buffer,
 /* 计算总共可以生成多少种不同的 payload */
 size_t fh_config_get_payload_count(struct http_config *config);
 
+/* 计算渲染 payload 所需缓冲区的最大长度 */
+size_t fh_config_get_max_payload_len(struct http_config *config);
+
 #endif /* FH_CONFIG_PARSER_H */
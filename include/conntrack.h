@@ -21,23 +21,72 @@
 #define FH_CONNTRACK_H
 
 #include <stdint.h>
-#include <sys/socket.h>
+
+#define FH_CONNTRACK_MAX         (1 << 24)
+#define FH_CONNTRACK_TIMEOUT_MAX 86400
+
+/* 包的方向：对端发来的包，或本机发出的包 */
+#define FH_CONNTRACK_IN  0
+#define FH_CONNTRACK_OUT 1
+
+/*
+ * 打包的 5 元组，由 fh_pkt4_parse()/fh_pkt6_parse() 按包中的方向生成。
+ * IPv4 地址使用 IPv4-mapped IPv6 表示，端口为网络字节序，
+ * 填充字节必须为 0，以便直接按字节比较和计算哈希。
+ */
+struct fh_flow_key {
+    uint8_t saddr[16];
+    uint8_t daddr[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t pad[3];
+};
 
 int fh_conntrack_setup(void);
 
 void fh_conntrack_cleanup(void);
 
 /*
- * 增加连接的包计数，如果达到阈值则返回 1，否则返回 0
+ * 推进超时时钟并清除到期的连接，每收到一批包调用一次
+ */
+void fh_conntrack_tick(void);
+
+/*
+ * 记录入站 SYN 的 TTL、MSS 选项（没有时为 0）与链路层地址，
+ * key 为该 SYN 的键
+ * 返回 -1 表示错误
+ */
+int fh_conntrack_learn(const struct fh_flow_key *key, uint8_t ttl,
+                       uint16_t mss, uint8_t hwaddr[8]);
+
+/*
+ * 记录对端 SYN-ACK 的 MSS 选项（出站连接），key 为该 SYN-ACK 的键
+ * 返回 -1 表示错误
+ */
+int fh_conntrack_learn_mss(const struct fh_flow_key *key, uint16_t mss);
+
+/*
+ * 取出本机发出的包所属连接记录的 SYN 信息
+ * 找到返回 0，否则返回 1
+ */
+int fh_conntrack_srcinfo(const struct fh_flow_key *key, uint8_t *ttl,
+                         uint16_t *mss, uint8_t hwaddr[8]);
+
+/*
+ * 增加连接中 dir 方向的包计数，如果达到阈值则返回 1，否则返回 0
  * 返回 -1 表示错误
+ * *mss 置为记录的对端 MSS，未知时为 0
+ * srcinfo_unavail 非 NULL 时，同时取出记录的 SYN 信息，
+ * 没有记录时 *srcinfo_unavail 置 1
  */
-int fh_conntrack_increment(struct sockaddr *saddr, struct sockaddr *daddr,
-                           uint16_t sport, uint16_t dport);
+int fh_conntrack_increment(const struct fh_flow_key *key, int dir,
+                           uint16_t *mss, int *srcinfo_unavail, uint8_t *ttl,
+                           uint8_t hwaddr[8]);
 
 /*
  * 清理连接（当检测到 FIN/RST 时调用）
  */
-void fh_conntrack_remove(struct sockaddr *saddr, struct sockaddr *daddr,
-                         uint16_t sport, uint16_t dport);
+void fh_conntrack_remove(const struct fh_flow_key *key, int dir);
 
 #endif /* FH_CONNTRACK_H */
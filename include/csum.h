@@ -0,0 +1,40 @@
+/*
+ * csum.h - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FH_CSUM_H
+#define FH_CSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void fh_csum_setup(void);
+
+int fh_csum_use(const char *name);
+
+const char *fh_csum_name(void);
+
+uint32_t fh_csum_partial(const void *data, size_t len, uint32_t sum);
+
+uint32_t fh_csum_add(uint32_t sum, uint32_t part, size_t off);
+
+uint32_t fh_csum_replace(uint32_t sum, uint32_t old_sum, uint32_t new_sum);
+
+uint16_t fh_csum_fold(uint32_t sum);
+
+#endif /* FH_CSUM_H */
@@ -40,15 +40,26 @@ struct fh_context {
     /* -i */ const char **iface;
     /* -k */ int killproc;
     /* -m */ uint32_t fwmark;
+    /* -N */ uint32_t conntrack_size;
     /* -n */ uint32_t nfqnum;
+    /* -n */ uint32_t nfqcnt;
+    /* -n */ uint32_t thr_nfqnum;
     /* -r */ int repeat;
     /* -s */ int silent;
     /* -T */ uint32_t packet_threshold;
+    /* -T */ int thr_kernel;
     /* -t */ uint8_t ttl;
     /* -w */ const char *logpath;
     /* -x */ uint32_t fwmask;
     /* -y */ int dynamic_pct;
     /* -z */ int use_iptables;
+    /* --seed */ int use_seed;
+    /* --seed */ uint64_t seed;
+    /* --tx-ring */ int tx_ring;
+    /* --qdisc-bypass */ int qdisc_bypass;
+    /* --io-uring */ int use_uring;
+    /* --xdp */ int use_xdp;
+    /* --flow-timeout */ uint32_t flow_timeout;
 };
 
 extern struct fh_context g_ctx;
@@ -24,13 +24,16 @@
 #include <stdlib.h>
 #include <netinet/tcp.h>
 
+#include "conntrack.h"
+
 int fh_pkt4_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
                   struct sockaddr *daddr, uint8_t *ttl,
-                  struct tcphdr **tcph_ptr, int *tcp_payload_len);
+                  struct tcphdr **tcph_ptr, int *tcp_payload_len,
+                  struct fh_flow_key *key);
 
 int fh_pkt4_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
                  struct sockaddr *daddr, uint8_t ttl, uint16_t sport_be,
                  uint16_t dport_be, uint32_t seq_be, uint32_t ackseq_be,
-                 int psh, uint8_t *tcp_payload, size_t tcp_payload_size);
+                 int psh, size_t tcp_payload_size, uint32_t tcp_payload_sum);
 
 #endif /* FH_IPV4PKT_H */
@@ -20,6 +20,9 @@
 #ifndef FH_LOGGING_H
 #define FH_LOGGING_H
 
+#include <stdint.h>
+#include <sys/socket.h>
+
 #define T(FUNC)    ("    at " #FUNC "()")
 #define E(...)     fh_logger(__func__, __FILE__, __LINE__, 0, __VA_ARGS__)
 #define EE(...)    fh_logger(__func__, __FILE__, __LINE__, 1, __VA_ARGS__)
@@ -28,6 +31,10 @@
     if (!g_ctx.silent) { \
         E(__VA_ARGS__);  \
     }
+#define E_FLOW(...)                                      \
+    if (!g_ctx.silent) {                                 \
+        fh_logger_flow(__FILE__, __LINE__, __VA_ARGS__); \
+    }
 
 int fh_logger_setup(void);
 
@@ -38,4 +45,9 @@ void fh_logger(const char *funcname, const char *filename, unsigned long line,
 
 void fh_logger_raw(const char *fmt, ...);
 
+void fh_logger_flow(const char *filename, unsigned long line,
+                    const char *arrow, uint32_t arg, struct sockaddr *addr1,
+                    uint16_t port1_be, struct sockaddr *addr2,
+                    uint16_t port2_be);
+
 #endif /* FH_LOGGING_H */
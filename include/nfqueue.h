@@ -20,6 +20,8 @@
 #ifndef FH_NFQUEUE_H
 #define FH_NFQUEUE_H
 
+#define FH_NFQ_MAX 64
+
 int fh_nfq_setup(void);
 
 void fh_nfq_cleanup(void);
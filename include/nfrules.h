@@ -20,8 +20,12 @@
 #ifndef FH_NFRULES_H
 #define FH_NFRULES_H
 
+#include <stddef.h>
+
 int fh_nfrules_setup(void);
 
 void fh_nfrules_cleanup(void);
 
+int fh_nfrules_nfqstr(char *buff, size_t size, char sep);
+
 #endif /* FH_NFRULES_H */
@@ -22,6 +22,10 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
+
+/* max number of pieces a payload is sent in */
+#define FH_PAYLOAD_PIECE_MAX 64
 
 enum payload_type {
     FH_PAYLOAD_END = 0,
@@ -43,10 +47,21 @@ struct payload_info {
     char *info;
 };
 
+/*
+    A payload ready to be sent: the pieces, in order, are the template kept
+    by the payload module with its dynamic fields rendered in between.
+*/
+struct fh_payload {
+    struct iovec piece[FH_PAYLOAD_PIECE_MAX];
+    int piece_cnt;
+    size_t len;
+    uint32_t sum;
+};
+
 int fh_payload_setup(void);
 
 void fh_payload_cleanup(void);
 
-void th_payload_get(uint8_t **payload_ptr, size_t *payload_len);
+int th_payload_get(struct fh_payload *payload);
 
 #endif /* FH_PAYLOAD_H */
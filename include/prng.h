@@ -1,5 +1,5 @@
 /*
- * srcinfo.h - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ * prng.h - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
  *
  * Copyright (C) 2025  MikeWang000000
  *
@@ -17,18 +17,17 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#ifndef FH_SRCINFO_H
-#define FH_SRCINFO_H
+#ifndef FH_PRNG_H
+#define FH_PRNG_H
 
 #include <stdint.h>
-#include <sys/socket.h>
 
-int fh_srcinfo_setup(void);
+int fh_prng_setup(void);
 
-void fh_srcinfo_cleanup(void);
+void th_prng_seed(uint64_t stream);
 
-int fh_srcinfo_put(struct sockaddr *addr, uint8_t ttl, uint8_t hwaddr[8]);
+uint64_t th_prng_u64(void);
 
-int fh_srcinfo_get(struct sockaddr *addr, uint8_t *ttl, uint8_t hwaddr[8]);
+uint32_t th_prng_below(uint32_t bound);
 
-#endif /* FH_SRCINFO_H */
+#endif /* FH_PRNG_H */
@@ -23,11 +23,13 @@
 #include <stdint.h>
 #include <linux/if_packet.h>
 
+#define FH_RAWSEND_REPEAT_MAX 10
+
 int fh_rawsend_setup(void);
 
 void fh_rawsend_cleanup(void);
 
 int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
-                      int *modified);
+                      int thr_hit, int *modified);
 
 #endif /* FH_RAWSEND_H */
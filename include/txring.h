@@ -0,0 +1,39 @@
+/*
+ * txring.h - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FH_TXRING_H
+#define FH_TXRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/if_packet.h>
+
+int fh_txring_setup(void);
+
+void fh_txring_cleanup(void);
+
+int th_txring_reserve(size_t frame_cnt, size_t frame_len);
+
+uint8_t *th_txring_frame(size_t idx);
+
+void th_txring_fill(size_t idx, size_t len);
+
+int th_txring_send(struct sockaddr_ll *sll, size_t frame_cnt);
+
+#endif /* FH_TXRING_H */
@@ -0,0 +1,59 @@
+/*
+ * uring.h - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FH_URING_H
+#define FH_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fh_uring;
+
+struct fh_uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+
+struct fh_uring *fh_uring_create(unsigned int entries);
+
+void fh_uring_destroy(struct fh_uring *ring);
+
+int fh_uring_provide_bufs(struct fh_uring *ring, char *base,
+                          unsigned int buf_len, unsigned int buf_cnt);
+
+char *fh_uring_buf(struct fh_uring *ring, uint32_t cqe_flags);
+
+void fh_uring_put_buf(struct fh_uring *ring, uint32_t cqe_flags);
+
+int fh_uring_more(uint32_t cqe_flags);
+
+int fh_uring_recv_multishot(struct fh_uring *ring, int fd,
+                            uint64_t user_data);
+
+int fh_uring_send(struct fh_uring *ring, int fd, const void *buf, size_t len,
+                  int link, uint64_t user_data);
+
+int fh_uring_space(struct fh_uring *ring);
+
+int fh_uring_submit_wait(struct fh_uring *ring, unsigned int wait_nr);
+
+int fh_uring_get_cqe(struct fh_uring *ring, struct fh_uring_cqe *cqe);
+
+#endif /* FH_URING_H */
@@ -0,0 +1,45 @@
+/*
+ * xsk.h - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FH_XSK_H
+#define FH_XSK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/if_packet.h>
+
+struct fh_xsk;
+
+int fh_xsk_setup(void);
+
+void fh_xsk_cleanup(void);
+
+struct fh_xsk *fh_xsk_acquire(struct sockaddr_ll *sll, size_t frame_cnt,
+                              size_t frame_len);
+
+uint8_t *fh_xsk_frame(struct fh_xsk *xsk, size_t idx);
+
+void fh_xsk_fill(struct fh_xsk *xsk, size_t idx, size_t len);
+
+int fh_xsk_send(struct fh_xsk *xsk, struct sockaddr_ll *sll,
+                size_t frame_cnt);
+
+void fh_xsk_release(struct fh_xsk *xsk);
+
+#endif /* FH_XSK_H */
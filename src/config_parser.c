@@ -33,8 +33,6 @@
 #define MAX_URIS          300
 #define MAX_HEADERS       150
 #define MAX_HEADER_VALUES 60
-#define MAX_BODY_SIZE     24576
-#define MAX_PAYLOAD_COUNT 100000 /* 最多生成 10 万个 payload，防止 OOM */
 
 /* 去除字符串首尾空白字符 */
 static char *trim_whitespace(char *str)
@@ -498,10 +496,64 @@ size_t fh_config_get_payload_count(struct http_config *config)
     /* 基础组合数：methods * uris */
     count = config->method_count * config->uri_count;
 
-    /* 乘以每个 header 的值数量 */
+    /* 乘以每个 header 的值数量，溢出时取 SIZE_MAX */
     for (i = 0; i < config->header_count; i++) {
+        if (config->headers[i].value_count &&
+            count > SIZE_MAX / config->headers[i].value_count) {
+            return SIZE_MAX;
+        }
         count *= config->headers[i].value_count;
     }
 
     return count;
 }
+
+
+/* 计算渲染 payload 所需缓冲区的最大长度（含结尾的 '\0'） */
+size_t fh_config_get_max_payload_len(struct http_config *config)
+{
+    size_t len, max, n;
+    size_t i, j;
+    int has_body;
+
+    if (!config) {
+        return 0;
+    }
+
+    /* 请求行："%s %s HTTP/1.1\r\n" */
+    has_body = 0;
+    max = 0;
+    for (i = 0; i < config->method_count; i++) {
+        n = strlen(config->methods[i]);
+        max = n > max ? n : max;
+        has_body |= method_needs_body(config->methods[i]);
+    }
+    len = max + strlen("  HTTP/1.1\r\n");
+
+    max = 0;
+    for (i = 0; i < config->uri_count; i++) {
+        n = strlen(config->uris[i]);
+        max = n > max ? n : max;
+    }
+    len += max;
+
+    /* Headers："%s: %s\r\n"，取每个 header 最长的值 */
+    for (i = 0; i < config->header_count; i++) {
+        max = 0;
+        for (j = 0; j < config->headers[i].value_count; j++) {
+            n = strlen(config->headers[i].values[j]);
+            max = n > max ? n : max;
+        }
+        len += strlen(config->headers[i].name) + strlen(": \r\n") + max;
+    }
+
+    /* Content-Length 及 body */
+    if (has_body && config->body && config->body_len > 0) {
+        len += snprintf(NULL, 0, "Content-Length: %zu\r\n",
+                        config->body_len);
+        len += config->body_len;
+    }
+
+    /* Header 结束空行及 '\0' */
+    return len + strlen("\r\n") + 1;
+}
@@ -21,168 +21,468 @@
 #include "conntrack.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONNTRACK_X86 1
+#include <immintrin.h>
+#endif /* __x86_64__ || __i386__ */
 
 #include "logging.h"
 #include "globvar.h"
 
-#define CAPACITY           1000
-#define CONNECTION_TIMEOUT 300 /* 5 分钟超时 */
+#define MAX_PROBE 32         /* 开放寻址的最大探测长度 */
+#define SLOT_NIL  UINT32_MAX /* 链表中的空链接 */
+
+/*
+ * 两层时间轮，精度 1 秒：第一层 256 个桶，每桶 1 秒；
+ * 第二层 64 个桶，每桶 256 秒。更远的表项放在第二层最后一个桶，
+ * 到期前重新分配。时钟由 fh_conntrack_tick() 每批推进一次。
+ */
+#define WHEEL0_BITS 8
+#define WHEEL1_BITS 6
+#define WHEEL0_SIZE (1U << WHEEL0_BITS)
+#define WHEEL1_SIZE (1U << WHEEL1_BITS)
 
+/*
+ * 连接表同时保存入站 SYN 的 TTL 与链路层地址（原 srcinfo），
+ * 以及对端在 SYN / SYN-ACK 中通告的 MSS，每个包只需一次哈希查找。
+ */
 struct connection {
-    int initialized;
-    struct sockaddr_storage saddr;
-    struct sockaddr_storage daddr;
-    uint16_t sport;
-    uint16_t dport;
-    uint32_t packet_count;
-    time_t last_seen;
+    struct fh_flow_key key; /* 按入站方向保存：源为对端，目的为本机 */
+    uint32_t hash;
+    uint32_t packet_count[2]; /* 按包的方向分别计数 */
+    uint32_t last_seen;       /* 粗粒度单调时钟，单位为秒 */
+    uint32_t tw_prev;         /* 所在时间轮桶的双向链表 */
+    uint32_t tw_next;
+    uint32_t lru_prev;        /* 按最近使用排序的双向链表 */
+    uint32_t lru_next;
+    uint16_t tw_bucket;
+    uint8_t initialized;
+    uint8_t has_srcinfo;
+    uint8_t ttl;
+    uint16_t mss; /* 对端通告的 MSS，0 表示未知 */
+    uint8_t hwaddr[8];
 };
 
 static struct connection *conns = NULL;
-static size_t conns_count = 0;
+static size_t conns_mask = 0;
+static uint64_t hash_seed = 0;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * LRU 链表：表头为最近使用的连接，表尾为最久未使用的连接。
+ * 表项数达到 -N 时淘汰表尾，开销为常数。
+ */
+static uint32_t lru_head = SLOT_NIL;
+static uint32_t lru_tail = SLOT_NIL;
+static size_t conns_cnt = 0;
+
+static uint32_t wheel[WHEEL0_SIZE + WHEEL1_SIZE];
+static uint32_t wheel_time = 0; /* 时间轮已推进到的时刻，也是当前时间 */
+
+/*
+ * 统一按入站方向保存键，使同一连接两个方向的包对应同一个表项。
+ */
+static void orient_key(struct fh_flow_key *out, const struct fh_flow_key *key,
+                       int dir)
+{
+    if (dir == FH_CONNTRACK_IN) {
+        *out = *key;
+        return;
+    }
+
+    memcpy(out->saddr, key->daddr, sizeof(out->saddr));
+    memcpy(out->daddr, key->saddr, sizeof(out->daddr));
+    out->sport = key->dport;
+    out->dport = key->sport;
+    out->proto = key->proto;
+    memset(out->pad, 0, sizeof(out->pad));
+}
+
+#ifdef CONNTRACK_X86
+/*
+ * 两个地址各用一次 128 位加载比较，端口和协议合成一个 64 位字比较。
+ */
+__attribute__((target("sse2"))) static int
+key_equal(const struct fh_flow_key *a, const struct fh_flow_key *b)
+{
+    __m128i s, d;
+    uint64_t ta, tb;
+
+    s = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) a->saddr),
+                       _mm_loadu_si128((const __m128i *) b->saddr));
+    d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) a->daddr),
+                       _mm_loadu_si128((const __m128i *) b->daddr));
+    memcpy(&ta, &a->sport, sizeof(ta));
+    memcpy(&tb, &b->sport, sizeof(tb));
+
+    return _mm_movemask_epi8(_mm_and_si128(s, d)) == 0xffff && ta == tb;
+}
+#else
+static int key_equal(const struct fh_flow_key *a,
+                     const struct fh_flow_key *b)
+{
+    return !memcmp(a, b, sizeof(*a));
+}
+#endif /* CONNTRACK_X86 */
 
-static int same_addr(struct sockaddr *addr1, struct sockaddr *addr2)
+static uint64_t mix64(uint64_t x)
 {
-    struct sockaddr_in *addr_in_1, *addr_in_2;
-    struct sockaddr_in6 *addr_in6_1, *addr_in6_2;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint32_t hash_key(const struct fh_flow_key *key)
+{
+    uint64_t words[sizeof(*key) / sizeof(uint64_t)], h;
+    size_t i;
+
+    memcpy(words, key, sizeof(words));
 
-    if (addr1->sa_family != addr2->sa_family) {
-        return 0;
+    h = hash_seed;
+    for (i = 0; i < sizeof(words) / sizeof(*words); i++) {
+        h ^= words[i];
+        h *= 0x9e3779b97f4a7c15ULL;
+        h = (h << 31) | (h >> 33);
     }
 
-    if (addr1->sa_family == AF_INET) {
-        addr_in_1 = (struct sockaddr_in *) addr1;
-        addr_in_2 = (struct sockaddr_in *) addr2;
-        return addr_in_1->sin_addr.s_addr == addr_in_2->sin_addr.s_addr;
-    } else if (addr1->sa_family == AF_INET6) {
-        addr_in6_1 = (struct sockaddr_in6 *) addr1;
-        addr_in6_2 = (struct sockaddr_in6 *) addr2;
-        return memcmp(&addr_in6_1->sin6_addr, &addr_in6_2->sin6_addr,
-                      sizeof(addr_in6_1->sin6_addr)) == 0;
+    return (uint32_t) mix64(h);
+}
+
+static uint32_t coarse_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return (uint32_t) ts.tv_sec;
+}
+
+/*
+ * 根据到期时间选择桶：256 秒以内的放在第一层，
+ * 否则按 256 秒为单位放在第二层。
+ */
+static unsigned int wheel_bucket(uint32_t expire)
+{
+    uint32_t blocks;
+
+    if (expire - wheel_time < WHEEL0_SIZE) {
+        return expire & (WHEEL0_SIZE - 1);
+    }
+
+    blocks = (expire >> WHEEL0_BITS) - (wheel_time >> WHEEL0_BITS);
+    if (blocks >= WHEEL1_SIZE) {
+        blocks = WHEEL1_SIZE - 1;
+    }
+
+    return WHEEL0_SIZE +
+           (((wheel_time >> WHEEL0_BITS) + blocks) & (WHEEL1_SIZE - 1));
+}
+
+static void wheel_link(uint32_t idx, unsigned int bucket)
+{
+    struct connection *conn;
+
+    conn = &conns[idx];
+    conn->tw_bucket = bucket;
+    conn->tw_prev = SLOT_NIL;
+    conn->tw_next = wheel[bucket];
+    if (conn->tw_next != SLOT_NIL) {
+        conns[conn->tw_next].tw_prev = idx;
+    }
+    wheel[bucket] = idx;
+}
+
+static void wheel_unlink(uint32_t idx)
+{
+    struct connection *conn;
+
+    conn = &conns[idx];
+    if (conn->tw_prev != SLOT_NIL) {
+        conns[conn->tw_prev].tw_next = conn->tw_next;
+    } else {
+        wheel[conn->tw_bucket] = conn->tw_next;
+    }
+    if (conn->tw_next != SLOT_NIL) {
+        conns[conn->tw_next].tw_prev = conn->tw_prev;
+    }
+}
+
+static void lru_link(uint32_t idx)
+{
+    struct connection *conn;
+
+    conn = &conns[idx];
+    conn->lru_prev = SLOT_NIL;
+    conn->lru_next = lru_head;
+    if (lru_head != SLOT_NIL) {
+        conns[lru_head].lru_prev = idx;
+    } else {
+        lru_tail = idx;
+    }
+    lru_head = idx;
+}
+
+static void lru_unlink(uint32_t idx)
+{
+    struct connection *conn;
+
+    conn = &conns[idx];
+    if (conn->lru_prev != SLOT_NIL) {
+        conns[conn->lru_prev].lru_next = conn->lru_next;
+    } else {
+        lru_head = conn->lru_next;
+    }
+    if (conn->lru_next != SLOT_NIL) {
+        conns[conn->lru_next].lru_prev = conn->lru_prev;
+    } else {
+        lru_tail = conn->lru_prev;
     }
-    return 0;
 }
 
-static int same_connection(struct connection *conn, struct sockaddr *saddr,
-                           struct sockaddr *daddr, uint16_t sport,
-                           uint16_t dport)
+/*
+ * 表项移动到槽位 to 之后，修正两个链表中指向它的链接。
+ */
+static void relink_moved(uint32_t to)
 {
-    if (!conn->initialized) {
-        return 0;
+    struct connection *moved;
+
+    moved = &conns[to];
+
+    if (moved->tw_prev != SLOT_NIL) {
+        conns[moved->tw_prev].tw_next = to;
+    } else {
+        wheel[moved->tw_bucket] = to;
+    }
+    if (moved->tw_next != SLOT_NIL) {
+        conns[moved->tw_next].tw_prev = to;
     }
 
-    if (conn->sport != sport || conn->dport != dport) {
-        return 0;
+    if (moved->lru_prev != SLOT_NIL) {
+        conns[moved->lru_prev].lru_next = to;
+    } else {
+        lru_head = to;
+    }
+    if (moved->lru_next != SLOT_NIL) {
+        conns[moved->lru_next].lru_prev = to;
+    } else {
+        lru_tail = to;
     }
+}
 
-    if (!same_addr((struct sockaddr *) &conn->saddr, saddr)) {
-        return 0;
+/*
+ * 移到 LRU 表头并刷新最后活动时间。
+ * 时钟按秒推进，同一秒内的包不会在时间轮中移动表项。
+ */
+static void touch_connection(struct connection *conn)
+{
+    unsigned int bucket;
+
+    if (lru_head != (uint32_t) (conn - conns)) {
+        lru_unlink(conn - conns);
+        lru_link(conn - conns);
     }
 
-    if (!same_addr((struct sockaddr *) &conn->daddr, daddr)) {
-        return 0;
+    if (conn->last_seen == wheel_time) {
+        return;
     }
+    conn->last_seen = wheel_time;
 
-    return 1;
+    bucket = wheel_bucket(wheel_time + g_ctx.flow_timeout);
+    if (bucket != conn->tw_bucket) {
+        wheel_unlink(conn - conns);
+        wheel_link(conn - conns, bucket);
+    }
 }
 
-static struct connection *find_connection(struct sockaddr *saddr,
-                                          struct sockaddr *daddr,
-                                          uint16_t sport, uint16_t dport)
+static struct connection *find_connection(const struct fh_flow_key *key,
+                                          uint32_t hash)
 {
-    size_t i;
+    size_t i, pos;
+    struct connection *conn;
 
-    for (i = 0; i < conns_count; i++) {
-        if (same_connection(&conns[i], saddr, daddr, sport, dport)) {
-            return &conns[i];
+    for (i = 0; i < MAX_PROBE; i++) {
+        pos = (hash + i) & conns_mask;
+        conn = &conns[pos];
+        if (!conn->initialized) {
+            return NULL;
+        }
+        if (conn->hash == hash && key_equal(&conn->key, key)) {
+            return conn;
         }
     }
 
     return NULL;
 }
 
-static struct connection *find_or_create_connection(struct sockaddr *saddr,
-                                                    struct sockaddr *daddr,
-                                                    uint16_t sport,
-                                                    uint16_t dport)
+/*
+ * 删除槽位并做反向移位（backward shift），保持探测链连续，
+ * 因此不需要墓碑标记。
+ */
+static void remove_connection(struct connection *conn)
 {
-    struct connection *conn;
-    time_t now;
-    size_t i;
+    size_t i, j, home;
 
-    /* 先尝试查找现有连接 */
-    conn = find_connection(saddr, daddr, sport, dport);
+    i = conn - conns;
+
+    wheel_unlink(i);
+    lru_unlink(i);
+    conns_cnt--;
+
+    for (;;) {
+        conns[i].initialized = 0;
+
+        j = i;
+        for (;;) {
+            j = (j + 1) & conns_mask;
+            if (!conns[j].initialized) {
+                return;
+            }
+
+            /* 槽位 j 的元素可以移动到 i，当且仅当其起始位置不在 (i, j] */
+            home = conns[j].hash & conns_mask;
+            if (((j - home) & conns_mask) >= ((j - i) & conns_mask)) {
+                break;
+            }
+        }
+
+        conns[i] = conns[j];
+        relink_moved(i);
+        i = j;
+    }
+}
+
+static struct connection *
+find_or_create_connection(const struct fh_flow_key *key, uint32_t hash)
+{
+    struct connection *conn, *oldest;
+    size_t i, pos;
+
+    conn = find_connection(key, hash);
     if (conn) {
         return conn;
     }
 
-    /* 清理超时的连接 */
-    now = time(NULL);
-    for (i = 0; i < conns_count; i++) {
-        if (conns[i].initialized &&
-            (now - conns[i].last_seen) > CONNECTION_TIMEOUT) {
-            conns[i].initialized = 0;
-        }
+    /* 表已满：淘汰 LRU 表尾，即最久未使用的连接 */
+    if (conns_cnt >= g_ctx.conntrack_size) {
+        remove_connection(&conns[lru_tail]);
     }
 
-    /* 查找空闲槽位 */
-    for (i = 0; i < conns_count; i++) {
-        if (!conns[i].initialized) {
-            conn = &conns[i];
+    oldest = NULL;
+
+    /*
+     * 在探测窗口内查找空槽位；同时记住最久未活动的槽位，
+     * 仅在窗口被占满时复用。
+     */
+    for (i = 0; i < MAX_PROBE; i++) {
+        pos = (hash + i) & conns_mask;
+        conn = &conns[pos];
+
+        if (!conn->initialized) {
+            conns_cnt++;
             goto init;
         }
-    }
-
-    /* 如果数组未满，添加新连接 */
-    if (conns_count < CAPACITY) {
-        conn = &conns[conns_count++];
-        goto init;
-    }
 
-    /* 数组已满，使用 LRU：找到最久未使用的连接 */
-    conn = &conns[0];
-    for (i = 1; i < conns_count; i++) {
-        if (conns[i].last_seen < conn->last_seen) {
-            conn = &conns[i];
+        if (!oldest ||
+            (int32_t) (conn->last_seen - oldest->last_seen) < 0) {
+            oldest = conn;
         }
     }
 
+    conn = oldest;
+    wheel_unlink(conn - conns);
+    lru_unlink(conn - conns);
+
 init:
     memset(conn, 0, sizeof(*conn));
     conn->initialized = 1;
+    conn->key = *key;
+    conn->hash = hash;
+    conn->last_seen = wheel_time;
+    wheel_link(conn - conns, wheel_bucket(wheel_time + g_ctx.flow_timeout));
+    lru_link(conn - conns);
 
-    if (saddr->sa_family == AF_INET) {
-        memcpy(&conn->saddr, saddr, sizeof(struct sockaddr_in));
-        memcpy(&conn->daddr, daddr, sizeof(struct sockaddr_in));
-    } else if (saddr->sa_family == AF_INET6) {
-        memcpy(&conn->saddr, saddr, sizeof(struct sockaddr_in6));
-        memcpy(&conn->daddr, daddr, sizeof(struct sockaddr_in6));
-    } else {
-        return NULL;
-    }
+    return conn;
+}
 
-    conn->sport = sport;
-    conn->dport = dport;
-    conn->packet_count = 0;
-    conn->last_seen = time(NULL);
+/*
+ * 将时间轮推进到 now，清除途经各秒到期的连接。
+ */
+static void wheel_advance(uint32_t now)
+{
+    uint32_t idx, next;
+    unsigned int bucket;
+
+    while ((int32_t) (now - wheel_time) > 0) {
+        wheel_time++;
+
+        if (!(wheel_time & (WHEEL0_SIZE - 1))) {
+            /* 第一层转完一圈，把第二层当前桶的表项重新分配 */
+            bucket = WHEEL0_SIZE +
+                     ((wheel_time >> WHEEL0_BITS) & (WHEEL1_SIZE - 1));
+            idx = wheel[bucket];
+            wheel[bucket] = SLOT_NIL;
+            while (idx != SLOT_NIL) {
+                next = conns[idx].tw_next;
+                wheel_link(idx, wheel_bucket(conns[idx].last_seen +
+                                             g_ctx.flow_timeout));
+                idx = next;
+            }
+        }
 
-    return conn;
+        /* 第一层当前桶中的表项都在此刻到期 */
+        bucket = wheel_time & (WHEEL0_SIZE - 1);
+        while (wheel[bucket] != SLOT_NIL) {
+            remove_connection(&conns[wheel[bucket]]);
+        }
+    }
 }
 
 int fh_conntrack_setup(void)
 {
-    conns = calloc(CAPACITY, sizeof(*conns));
+    size_t slots;
+    ssize_t res;
+
+    /* 槽位数取不小于 2 倍容量的 2 的幂，负载因子不超过 0.5 */
+    slots = 1;
+    while (slots < 2 * (size_t) g_ctx.conntrack_size) {
+        slots <<= 1;
+    }
+    if (slots < MAX_PROBE) {
+        slots = MAX_PROBE;
+    }
+
+    conns = calloc(slots, sizeof(*conns));
     if (!conns) {
         E("ERROR: calloc(): %s", strerror(errno));
         return -1;
     }
-    conns_count = 0;
+    conns_mask = slots - 1;
+
+    memset(wheel, 0xff, sizeof(wheel));
+    lru_head = lru_tail = SLOT_NIL;
+    conns_cnt = 0;
+    wheel_time = coarse_now();
+
+    res = getrandom(&hash_seed, sizeof(hash_seed), GRND_NONBLOCK);
+    if (res != sizeof(hash_seed)) {
+        hash_seed = mix64((uint64_t) time(NULL) ^ (uint64_t) getpid());
+    }
+
+    E("conntrack table: %zu slots (%zu KB), timeout %" PRIu32 " s", slots,
+      slots * sizeof(*conns) / 1024, g_ctx.flow_timeout);
 
     return 0;
 }
@@ -191,45 +491,174 @@ void fh_conntrack_cleanup(void)
 {
     free(conns);
     conns = NULL;
-    conns_count = 0;
+    conns_mask = 0;
 }
 
-int fh_conntrack_increment(struct sockaddr *saddr, struct sockaddr *daddr,
-                           uint16_t sport, uint16_t dport)
+void fh_conntrack_tick(void)
 {
+    if (!conns) {
+        return;
+    }
+
+    pthread_mutex_lock(&conns_lock);
+
+    wheel_advance(coarse_now());
+
+    pthread_mutex_unlock(&conns_lock);
+}
+
+int fh_conntrack_learn(const struct fh_flow_key *key, uint8_t ttl,
+                       uint16_t mss, uint8_t hwaddr[8])
+{
+    uint32_t hash;
     struct connection *conn;
 
     if (!conns) {
         return -1;
     }
 
-    conn = find_or_create_connection(saddr, daddr, sport, dport);
-    if (!conn) {
+    hash = hash_key(key);
+
+    pthread_mutex_lock(&conns_lock);
+
+    conn = find_or_create_connection(key, hash);
+
+    touch_connection(conn);
+    conn->has_srcinfo = 1;
+    conn->ttl = ttl;
+    conn->mss = mss;
+    memcpy(conn->hwaddr, hwaddr, sizeof(conn->hwaddr));
+
+    pthread_mutex_unlock(&conns_lock);
+
+    return 0;
+}
+
+int fh_conntrack_learn_mss(const struct fh_flow_key *key, uint16_t mss)
+{
+    uint32_t hash;
+    struct connection *conn;
+
+    if (!conns) {
         return -1;
     }
 
-    conn->packet_count++;
-    conn->last_seen = time(NULL);
+    hash = hash_key(key);
+
+    pthread_mutex_lock(&conns_lock);
+
+    conn = find_or_create_connection(key, hash);
 
-    if (conn->packet_count >= g_ctx.packet_threshold) {
-        conn->packet_count = 0; /* 重置计数 */
-        return 1;               /* 达到阈值 */
+    touch_connection(conn);
+    conn->mss = mss;
+
+    pthread_mutex_unlock(&conns_lock);
+
+    return 0;
+}
+
+int fh_conntrack_srcinfo(const struct fh_flow_key *key, uint8_t *ttl,
+                         uint16_t *mss, uint8_t hwaddr[8])
+{
+    int ret;
+    uint32_t hash;
+    struct fh_flow_key okey;
+    struct connection *conn;
+
+    if (!conns) {
+        return 1;
     }
 
-    return 0; /* 未达到阈值 */
+    orient_key(&okey, key, FH_CONNTRACK_OUT);
+    hash = hash_key(&okey);
+
+    ret = 1;
+
+    pthread_mutex_lock(&conns_lock);
+
+    conn = find_connection(&okey, hash);
+    if (conn && conn->has_srcinfo) {
+        *ttl = conn->ttl;
+        *mss = conn->mss;
+        memcpy(hwaddr, conn->hwaddr, sizeof(conn->hwaddr));
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&conns_lock);
+
+    return ret;
 }
 
-void fh_conntrack_remove(struct sockaddr *saddr, struct sockaddr *daddr,
-                         uint16_t sport, uint16_t dport)
+int fh_conntrack_increment(const struct fh_flow_key *key, int dir,
+                           uint16_t *mss, int *srcinfo_unavail, uint8_t *ttl,
+                           uint8_t hwaddr[8])
 {
+    int ret;
+    uint32_t hash;
+    struct fh_flow_key okey;
+    struct connection *conn;
+
+    if (!conns) {
+        return -1;
+    }
+
+    orient_key(&okey, key, dir);
+    hash = hash_key(&okey);
+
+    pthread_mutex_lock(&conns_lock);
+
+    conn = find_or_create_connection(&okey, hash);
+
+    /* 计数到阈值为止，之后不再增加，保证每个方向只触发一次 */
+    if (conn->packet_count[dir] < g_ctx.packet_threshold) {
+        conn->packet_count[dir]++;
+    }
+    touch_connection(conn);
+
+    /*
+     * 与内核 conntrack 的计数方式一致：握手包 (SYN / SYN-ACK) 记为
+     * 该方向的第 1 个包，因此这里的第 n 个包是该方向的第 n + 1 个包。
+     */
+    if (conn->packet_count[dir] + 1 == g_ctx.packet_threshold) {
+        ret = 1; /* 达到阈值 */
+    } else {
+        ret = 0; /* 未达到阈值 */
+    }
+
+    *mss = conn->mss;
+
+    if (srcinfo_unavail) {
+        *srcinfo_unavail = !conn->has_srcinfo;
+        if (conn->has_srcinfo) {
+            *ttl = conn->ttl;
+            memcpy(hwaddr, conn->hwaddr, sizeof(conn->hwaddr));
+        }
+    }
+
+    pthread_mutex_unlock(&conns_lock);
+
+    return ret;
+}
+
+void fh_conntrack_remove(const struct fh_flow_key *key, int dir)
+{
+    uint32_t hash;
+    struct fh_flow_key okey;
     struct connection *conn;
 
     if (!conns) {
         return;
     }
 
-    conn = find_connection(saddr, daddr, sport, dport);
+    orient_key(&okey, key, dir);
+    hash = hash_key(&okey);
+
+    pthread_mutex_lock(&conns_lock);
+
+    conn = find_connection(&okey, hash);
     if (conn) {
-        conn->initialized = 0;
+        remove_connection(conn);
     }
+
+    pthread_mutex_unlock(&conns_lock);
 }
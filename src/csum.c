@@ -0,0 +1,261 @@
+/*
+ * csum.c - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "csum.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSUM_X86 1
+#include <immintrin.h>
+#endif /* __x86_64__ || __i386__ */
+
+/*
+    Internet checksum helpers (RFC 1071). Partial sums are kept folded to
+    16 bits, in the byte order of the data, so they can be stored and
+    combined freely. A partial sum of data starting at an odd offset is
+    combined with the others through fh_csum_add().
+
+    The bulk summing routine is picked once by fh_csum_setup() according
+    to the CPU. Short buffers always take the scalar path.
+*/
+
+#define CSUM_SIMD_MIN 64
+
+typedef uint64_t (*csum_fn)(const uint8_t *p, size_t len, uint64_t acc);
+
+struct csum_impl {
+    const char *name;
+    csum_fn fn;
+    int (*supported)(void);
+};
+
+static uint32_t fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+
+static uint64_t csum_scalar(const uint8_t *p, size_t len, uint64_t acc)
+{
+    uint32_t w32[4];
+    uint16_t w16;
+
+    for (; len >= 16; len -= 16, p += 16) {
+        memcpy(w32, p, 16);
+        acc += (uint64_t) w32[0] + w32[1] + w32[2] + w32[3];
+    }
+
+    for (; len >= 4; len -= 4, p += 4) {
+        memcpy(w32, p, 4);
+        acc += w32[0];
+    }
+
+    if (len >= 2) {
+        memcpy(&w16, p, 2);
+        acc += w16;
+        len -= 2;
+        p += 2;
+    }
+
+    if (len) {
+        w16 = 0;
+        memcpy(&w16, p, 1);
+        acc += w16;
+    }
+
+    return acc;
+}
+
+
+static int always(void)
+{
+    return 1;
+}
+
+
+#ifdef CSUM_X86
+/*
+    Both SIMD variants widen every 16-bit word to a 32-bit lane and add the
+    lanes up. A lane grows by at most 2 * 0xffff per block, so the lanes
+    are flushed into the 64-bit accumulator every 16384 blocks, well
+    before they can overflow.
+*/
+#define CSUM_FLUSH_BLOCKS 16384
+
+__attribute__((target("sse2"))) static uint64_t
+csum_sse2(const uint8_t *p, size_t len, uint64_t acc)
+{
+    size_t n;
+    __m128i zero, v, lanes;
+    uint32_t out[4];
+
+    zero = _mm_setzero_si128();
+
+    while (len >= 16) {
+        lanes = zero;
+        for (n = 0; len >= 16 && n < CSUM_FLUSH_BLOCKS;
+             n++, len -= 16, p += 16) {
+            v = _mm_loadu_si128((const __m128i *) p);
+            lanes = _mm_add_epi32(lanes, _mm_unpacklo_epi16(v, zero));
+            lanes = _mm_add_epi32(lanes, _mm_unpackhi_epi16(v, zero));
+        }
+        _mm_storeu_si128((__m128i *) out, lanes);
+        acc += (uint64_t) out[0] + out[1] + out[2] + out[3];
+    }
+
+    return csum_scalar(p, len, acc);
+}
+
+
+__attribute__((target("avx2"))) static uint64_t
+csum_avx2(const uint8_t *p, size_t len, uint64_t acc)
+{
+    size_t n;
+    __m256i zero, v, lanes;
+    uint32_t out[8];
+
+    zero = _mm256_setzero_si256();
+
+    while (len >= 32) {
+        lanes = zero;
+        for (n = 0; len >= 32 && n < CSUM_FLUSH_BLOCKS;
+             n++, len -= 32, p += 32) {
+            v = _mm256_loadu_si256((const __m256i *) p);
+            lanes = _mm256_add_epi32(lanes, _mm256_unpacklo_epi16(v, zero));
+            lanes = _mm256_add_epi32(lanes, _mm256_unpackhi_epi16(v, zero));
+        }
+        _mm256_storeu_si256((__m256i *) out, lanes);
+        acc += (uint64_t) out[0] + out[1] + out[2] + out[3] + out[4] +
+               out[5] + out[6] + out[7];
+    }
+
+    return csum_sse2(p, len, acc);
+}
+
+
+static int have_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+
+static int have_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif /* CSUM_X86 */
+
+
+/* in order of preference, the last one always works */
+static const struct csum_impl impls[] = {
+#ifdef CSUM_X86
+    {"avx2", &csum_avx2, &have_avx2},
+    {"sse2", &csum_sse2, &have_sse2},
+#endif /* CSUM_X86 */
+    {"scalar", &csum_scalar, &always},
+};
+
+static const struct csum_impl *impl = &impls[sizeof(impls) /
+                                             sizeof(impls[0]) - 1];
+
+void fh_csum_setup(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (impls[i].supported()) {
+            impl = &impls[i];
+            break;
+        }
+    }
+}
+
+
+/*
+    Force a specific implementation, for benchmarking. Returns -1 if it is
+    unknown or not supported by this CPU.
+*/
+int fh_csum_use(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (strcmp(impls[i].name, name) == 0) {
+            if (!impls[i].supported()) {
+                return -1;
+            }
+            impl = &impls[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+const char *fh_csum_name(void)
+{
+    return impl->name;
+}
+
+
+uint32_t fh_csum_partial(const void *data, size_t len, uint32_t sum)
+{
+    if (len < CSUM_SIMD_MIN) {
+        return fold(csum_scalar(data, len, sum));
+    }
+    return fold(impl->fn(data, len, sum));
+}
+
+
+/*
+    Add the partial sum part of some data to sum, the partial sum of the
+    buffer that data sits in at byte offset off.
+*/
+uint32_t fh_csum_add(uint32_t sum, uint32_t part, size_t off)
+{
+    if (off & 1) {
+        part = ((part & 0xff) << 8) | (part >> 8);
+    }
+    return fold((uint64_t) sum + part);
+}
+
+
+/*
+    Replace the contribution of some data in a partial sum, given the
+    partial sums of its old and new contents (RFC 1624, eqn. 3).
+*/
+uint32_t fh_csum_replace(uint32_t sum, uint32_t old_sum, uint32_t new_sum)
+{
+    return fold((uint64_t) sum + (~old_sum & 0xffff) + new_sum);
+}
+
+
+uint16_t fh_csum_fold(uint32_t sum)
+{
+    return ~fold(sum) & 0xffff;
+}
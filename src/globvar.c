@@ -38,12 +38,23 @@ struct fh_context g_ctx = {.exit = 0,
                            /* -i */ .iface = NULL,
                            /* -k */ .killproc = 0,
                            /* -m */ .fwmark = 0x8000,
+                           /* -N */ .conntrack_size = 4096,
                            /* -n */ .nfqnum = 512,
+                           /* -n */ .nfqcnt = 1,
+                           /* -n */ .thr_nfqnum = 513,
                            /* -r */ .repeat = 2,
                            /* -s */ .silent = 0,
                            /* -T */ .packet_threshold = 100,
+                           /* -T */ .thr_kernel = 0,
                            /* -t */ .ttl = 3,
                            /* -w */ .logpath = NULL,
                            /* -x */ .fwmask = 0,
                            /* -y */ .dynamic_pct = 0,
-                           /* -z */ .use_iptables = 0};
+                           /* -z */ .use_iptables = 0,
+                           /* --seed */ .use_seed = 0,
+                           /* --seed */ .seed = 0,
+                           /* --tx-ring */ .tx_ring = 0,
+                           /* --qdisc-bypass */ .qdisc_bypass = 0,
+                           /* --io-uring */ .use_uring = 0,
+                           /* --xdp */ .use_xdp = 0,
+                           /* --flow-timeout */ .flow_timeout = 300};
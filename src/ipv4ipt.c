@@ -26,6 +26,7 @@
 
 #include "globvar.h"
 #include "logging.h"
+#include "nfrules.h"
 #include "process.h"
 
 static int ipt4_iface_setup(void)
@@ -88,9 +89,16 @@ static int ipt4_iface_setup(void)
 
 int fh_ipt4_setup(void)
 {
-    char xmark_str[64], nfqnum_str[32];
-    size_t i, ipt_cmds_cnt, ipt_opt_cmds_cnt;
+    char xmark_str[64], nfqnum_str[32], thr_nfqnum_str[32];
+    char thr_cnt_str[32];
+    size_t i, ipt_cmds_cnt, ipt_thr_cmds_cnt, ipt_opt_cmds_cnt;
     int res;
+    /*
+        Spread flows over all queues when a range is given. fanout_opt is
+        NULL for a single queue, which simply ends the argument list early.
+    */
+    char *nfqnum_opt = g_ctx.nfqcnt > 1 ? "--queue-balance" : "--queue-num";
+    char *fanout_opt = g_ctx.nfqcnt > 1 ? "--queue-cpu-fanout" : NULL;
     char *ipt_cmds[][32] = {
         {"iptables", "-w", "-t", "mangle", "-N", "FAKEHTTP_S", NULL},
 
@@ -170,7 +178,26 @@ int fh_ipt4_setup(void)
         */
         {"iptables", "-w", "-t", "mangle", "-A", "FAKEHTTP_R", "-p", "tcp",
          "--tcp-flags", "SYN,FIN,RST", "SYN", "-j", "NFQUEUE",
-         "--queue-bypass", "--queue-num", nfqnum_str, NULL}};
+         "--queue-bypass", nfqnum_opt, nfqnum_str, fanout_opt, NULL}};
+
+    char *ipt_thr_cmds[][32] = {
+        /*
+            Packet threshold (-T): let the kernel pick the <threshold>th
+            packet of each direction of a flow, counted by conntrack, and
+            send it to a dedicated queue. These rules come before the one
+            for the early ACK packets, as NFQUEUE is terminal.
+        */
+        {"iptables", "-w", "-t", "mangle", "-A", "FAKEHTTP_R", "-p", "tcp",
+         "--tcp-flags", "SYN,ACK,FIN,RST", "ACK", "-m", "connbytes",
+         "--connbytes", thr_cnt_str, "--connbytes-dir", "original",
+         "--connbytes-mode", "packets", "-j", "NFQUEUE", "--queue-bypass",
+         "--queue-num", thr_nfqnum_str, NULL},
+
+        {"iptables", "-w", "-t", "mangle", "-A", "FAKEHTTP_R", "-p", "tcp",
+         "--tcp-flags", "SYN,ACK,FIN,RST", "ACK", "-m", "connbytes",
+         "--connbytes", thr_cnt_str, "--connbytes-dir", "reply",
+         "--connbytes-mode", "packets", "-j", "NFQUEUE", "--queue-bypass",
+         "--queue-num", thr_nfqnum_str, NULL}};
 
     char *ipt_opt_cmds[][32] = {
         /*
@@ -189,10 +216,11 @@ int fh_ipt4_setup(void)
          "both",        "--connbytes-mode",
          "packets",     "-j",
          "NFQUEUE",     "--queue-bypass",
-         "--queue-num", nfqnum_str,
-         NULL}};
+         nfqnum_opt,    nfqnum_str,
+         fanout_opt,    NULL}};
 
     ipt_cmds_cnt = sizeof(ipt_cmds) / sizeof(*ipt_cmds);
+    ipt_thr_cmds_cnt = sizeof(ipt_thr_cmds) / sizeof(*ipt_thr_cmds);
     ipt_opt_cmds_cnt = sizeof(ipt_opt_cmds) / sizeof(*ipt_opt_cmds);
 
     res = snprintf(xmark_str, sizeof(xmark_str), "%" PRIu32 "/%" PRIu32,
@@ -202,8 +230,22 @@ int fh_ipt4_setup(void)
         return -1;
     }
 
-    res = snprintf(nfqnum_str, sizeof(nfqnum_str), "%" PRIu32, g_ctx.nfqnum);
-    if (res < 0 || (size_t) res >= sizeof(nfqnum_str)) {
+    res = fh_nfrules_nfqstr(nfqnum_str, sizeof(nfqnum_str), ':');
+    if (res < 0) {
+        E(T(fh_nfrules_nfqstr));
+        return -1;
+    }
+
+    res = snprintf(thr_nfqnum_str, sizeof(thr_nfqnum_str), "%" PRIu32,
+                   g_ctx.thr_nfqnum);
+    if (res < 0 || (size_t) res >= sizeof(thr_nfqnum_str)) {
+        E("ERROR: snprintf(): %s", "failure");
+        return -1;
+    }
+
+    res = snprintf(thr_cnt_str, sizeof(thr_cnt_str), "%" PRIu32 ":%" PRIu32,
+                   g_ctx.packet_threshold, g_ctx.packet_threshold);
+    if (res < 0 || (size_t) res >= sizeof(thr_cnt_str)) {
         E("ERROR: snprintf(): %s", "failure");
         return -1;
     }
@@ -218,6 +260,14 @@ int fh_ipt4_setup(void)
         }
     }
 
+    for (i = 0; i < ipt_thr_cmds_cnt; i++) {
+        res = fh_execute_command(ipt_thr_cmds[i], 1, NULL);
+        if (res < 0) {
+            E("WARNING: packet threshold rule is not available");
+            g_ctx.thr_kernel = 0;
+        }
+    }
+
     for (i = 0; i < ipt_opt_cmds_cnt; i++) {
         fh_execute_command(ipt_opt_cmds[i], 1, NULL);
     }
@@ -25,6 +25,7 @@
 
 #include "globvar.h"
 #include "logging.h"
+#include "nfrules.h"
 #include "process.h"
 
 static int nft4_iface_setup(void)
@@ -98,8 +99,11 @@ static int nft4_iface_setup(void)
 int fh_nft4_setup(void)
 {
     int res;
+    size_t i;
     char *nft_cmd[] = {"nft", "-f", "-", NULL};
-    char nft_conf_buff[2048];
+    char nft_conf_buff[2048], nfqnum_str[32];
+    const char *queue_flags;
+    static const char *ct_dirs[] = {"original", "reply"};
     char *nft_conf_fmt =
         "table ip fakehttp {\n"
         "    chain fh_prerouting {\n"
@@ -142,20 +146,32 @@ int fh_nft4_setup(void)
         /*
             send to nfqueue
         */
-        "        tcp flags & (syn | fin | rst) == syn queue num %" PRIu32
-        " bypass;\n"
+        "        tcp flags & (syn | fin | rst) == syn queue num %s %s;\n"
 
         "    }\n"
         "}\n";
 
     char *nft_conf_opt_fmt =
         "add rule ip fakehttp fh_rules tcp flags & (syn | ack | fin | rst) "
-        "== ack ct packets 2-4 queue num %" PRIu32 " bypass;\n";
+        "== ack ct packets 2-4 queue num %s %s;\n";
+
+    char *nft_conf_thr_fmt =
+        "add rule ip fakehttp fh_rules tcp flags & (syn | ack | fin | rst) "
+        "== ack ct %s packets %" PRIu32 " queue num %" PRIu32 " bypass;\n";
+
+    res = fh_nfrules_nfqstr(nfqnum_str, sizeof(nfqnum_str), '-');
+    if (res < 0) {
+        E(T(fh_nfrules_nfqstr));
+        return -1;
+    }
+
+    /* spread flows over all queues when a range is given */
+    queue_flags = g_ctx.nfqcnt > 1 ? "bypass,fanout" : "bypass";
 
     fh_nft4_cleanup();
 
     res = snprintf(nft_conf_buff, sizeof(nft_conf_buff), nft_conf_fmt,
-                   g_ctx.fwmask, g_ctx.fwmark, g_ctx.nfqnum);
+                   g_ctx.fwmask, g_ctx.fwmark, nfqnum_str, queue_flags);
     if (res < 0 || (size_t) res >= sizeof(nft_conf_buff)) {
         E("ERROR: snprintf(): %s", "failure");
         return -1;
@@ -167,12 +183,34 @@ int fh_nft4_setup(void)
         return -1;
     }
 
+    /*
+        Packet threshold (-T): let the kernel pick the <threshold>th packet
+        of each direction of a flow, counted by conntrack, and send it to a
+        dedicated queue, so that ordinary data packets never reach userspace.
+        These rules come before the one for the early ACK packets, as
+        NFQUEUE is terminal.
+    */
+    for (i = 0; i < sizeof(ct_dirs) / sizeof(*ct_dirs); i++) {
+        res = snprintf(nft_conf_buff, sizeof(nft_conf_buff), nft_conf_thr_fmt,
+                       ct_dirs[i], g_ctx.packet_threshold, g_ctx.thr_nfqnum);
+        if (res < 0 || (size_t) res >= sizeof(nft_conf_buff)) {
+            E("ERROR: snprintf(): %s", "failure");
+            return -1;
+        }
+
+        res = fh_execute_command(nft_cmd, 0, nft_conf_buff);
+        if (res < 0) {
+            E("WARNING: packet threshold rule is not available");
+            g_ctx.thr_kernel = 0;
+        }
+    }
+
     /*
         Also enqueue some of the early ACK packets to ensure the packet order.
         This rule is optional. We do not verify its execution result.
     */
     res = snprintf(nft_conf_buff, sizeof(nft_conf_buff), nft_conf_opt_fmt,
-                   g_ctx.nfqnum);
+                   nfqnum_str, queue_flags);
     if (res < 0 || (size_t) res >= sizeof(nft_conf_buff)) {
         E("ERROR: snprintf(): %s", "failure");
         return -1;
@@ -28,18 +28,20 @@
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <libnetfilter_queue/libnetfilter_queue_ipv4.h>
-#include <libnetfilter_queue/libnetfilter_queue_tcp.h>
 
+#include "csum.h"
 #include "globvar.h"
 #include "logging.h"
+#include "prng.h"
 
 int fh_pkt4_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
                   struct sockaddr *daddr, uint8_t *ttl,
-                  struct tcphdr **tcph_ptr, int *tcp_payload_len)
+                  struct tcphdr **tcph_ptr, int *tcp_payload_len,
+                  struct fh_flow_key *key)
 {
     struct iphdr *iph;
     struct tcphdr *tcph;
-    int iph_len, tcph_len;
+    int iph_len, tcph_len, tot_len;
     struct sockaddr_in *saddr_in, *daddr_in;
 
     saddr_in = (struct sockaddr_in *) saddr;
@@ -83,23 +85,46 @@ int fh_pkt4_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
     daddr_in->sin_family = AF_INET;
     daddr_in->sin_addr.s_addr = iph->daddr;
 
+    memset(key, 0, sizeof(*key));
+    key->saddr[10] = key->saddr[11] = 0xff;
+    memcpy(key->saddr + 12, &iph->saddr, sizeof(iph->saddr));
+    key->daddr[10] = key->daddr[11] = 0xff;
+    memcpy(key->daddr + 12, &iph->daddr, sizeof(iph->daddr));
+    key->sport = tcph->source;
+    key->dport = tcph->dest;
+    key->proto = IPPROTO_TCP;
+
     *ttl = iph->ttl;
     *tcph_ptr = tcph;
-    *tcp_payload_len = pkt_len - iph_len - tcph_len;
+    /*
+        The packet may be truncated by the NFQUEUE copy range, so take the
+        length from the IP header whenever it is usable.
+    */
+    tot_len = ntohs(iph->tot_len);
+    if (tot_len < iph_len + tcph_len) {
+        tot_len = pkt_len;
+    }
+    *tcp_payload_len = tot_len - iph_len - tcph_len;
 
     return 0;
 }
 
 
+/*
+    Build the IPv4 and TCP headers of a segment that carries
+    tcp_payload_size bytes of payload whose partial checksum is
+    tcp_payload_sum. The payload itself is not copied: the caller sends it
+    right after the headers with a second iovec. Returns the header length.
+*/
 int fh_pkt4_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
                  struct sockaddr *daddr, uint8_t ttl, uint16_t sport_be,
                  uint16_t dport_be, uint32_t seq_be, uint32_t ackseq_be,
-                 int psh, uint8_t *tcp_payload, size_t tcp_payload_size)
+                 int psh, size_t tcp_payload_size, uint32_t tcp_payload_sum)
 {
-    size_t pkt_len;
+    size_t hdr_len, pkt_len;
+    uint32_t sum;
     struct iphdr *iph;
     struct tcphdr *tcph;
-    uint8_t *tcppl;
     struct sockaddr_in *saddr_in, *daddr_in;
 
     if (saddr->sa_family != AF_INET || daddr->sa_family != AF_INET) {
@@ -110,22 +135,27 @@ int fh_pkt4_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
     saddr_in = (struct sockaddr_in *) saddr;
     daddr_in = (struct sockaddr_in *) daddr;
 
-    pkt_len = sizeof(*iph) + sizeof(*tcph) + tcp_payload_size;
-    if (buffer_size < pkt_len + 1) {
+    hdr_len = sizeof(*iph) + sizeof(*tcph);
+    if (buffer_size < hdr_len) {
         E("ERROR: %s", strerror(ENOBUFS));
         return -1;
     }
 
+    pkt_len = hdr_len + tcp_payload_size;
+    if (pkt_len > UINT16_MAX) {
+        E("ERROR: %s", strerror(EMSGSIZE));
+        return -1;
+    }
+
     iph = (struct iphdr *) buffer;
     tcph = (struct tcphdr *) (buffer + sizeof(*iph));
-    tcppl = buffer + sizeof(*iph) + sizeof(*tcph);
 
     memset(iph, 0, sizeof(*iph));
     iph->version = 4;
     iph->ihl = sizeof(*iph) / 4;
     iph->tos = 0;
     iph->tot_len = htons(pkt_len);
-    iph->id = ((rand() & 0xff) << 8) | (rand() & 0xff);
+    iph->id = (uint16_t) th_prng_u64();
     iph->frag_off = htons(1 << 14 /* DF */);
     iph->ttl = ttl;
     iph->protocol = IPPROTO_TCP;
@@ -145,12 +175,18 @@ int fh_pkt4_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
     tcph->check = 0;
     tcph->urg_ptr = 0;
 
-    if (tcp_payload_size) {
-        memcpy(tcppl, tcp_payload, tcp_payload_size);
-    }
-
     nfq_ip_set_checksum(iph);
-    nfq_tcp_compute_checksum_ipv4(tcph, iph);
 
-    return pkt_len;
+    /*
+        tcp_payload_sum is the partial checksum of the payload, computed
+        once by the payload module, so only the pseudo header and the TCP
+        header are summed here.
+    */
+    sum = fh_csum_partial(&iph->saddr, 2 * sizeof(iph->saddr),
+                          tcp_payload_sum);
+    sum += htons(IPPROTO_TCP) + htons(sizeof(*tcph) + tcp_payload_size);
+    sum = fh_csum_partial(tcph, sizeof(*tcph), sum);
+    tcph->check = fh_csum_fold(sum);
+
+    return hdr_len;
 }
@@ -27,19 +27,19 @@
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
-#include <libnetfilter_queue/libnetfilter_queue_ipv6.h>
-#include <libnetfilter_queue/libnetfilter_queue_tcp.h>
 
+#include "csum.h"
 #include "globvar.h"
 #include "logging.h"
 
 int fh_pkt6_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
                   struct sockaddr *daddr, uint8_t *ttl,
-                  struct tcphdr **tcph_ptr, int *tcp_payload_len)
+                  struct tcphdr **tcph_ptr, int *tcp_payload_len,
+                  struct fh_flow_key *key)
 {
     struct ip6_hdr *ip6h;
     struct tcphdr *tcph;
-    int ip6h_len, tcph_len;
+    int ip6h_len, tcph_len, tot_len;
     struct sockaddr_in6 *saddr_in6, *daddr_in6;
 
     saddr_in6 = (struct sockaddr_in6 *) saddr;
@@ -79,23 +79,41 @@ int fh_pkt6_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
     daddr_in6->sin6_family = AF_INET6;
     memcpy(&daddr_in6->sin6_addr, &ip6h->ip6_dst, sizeof(struct in6_addr));
 
+    memset(key, 0, sizeof(*key));
+    memcpy(key->saddr, &ip6h->ip6_src, sizeof(key->saddr));
+    memcpy(key->daddr, &ip6h->ip6_dst, sizeof(key->daddr));
+    key->sport = tcph->source;
+    key->dport = tcph->dest;
+    key->proto = IPPROTO_TCP;
+
     *ttl = ip6h->ip6_hlim;
     *tcph_ptr = tcph;
-    *tcp_payload_len = pkt_len - ip6h_len - tcph_len;
+    /*
+        The packet may be truncated by the NFQUEUE copy range, so take the
+        length from the IPv6 header whenever it is usable.
+    */
+    tot_len = ip6h_len + ntohs(ip6h->ip6_plen);
+    if (tot_len < ip6h_len + tcph_len) {
+        tot_len = pkt_len;
+    }
+    *tcp_payload_len = tot_len - ip6h_len - tcph_len;
 
     return 0;
 }
 
 
+/*
+    See fh_pkt4_make(). Returns the header length.
+*/
 int fh_pkt6_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
                  struct sockaddr *daddr, uint8_t ttl, uint16_t sport_be,
                  uint16_t dport_be, uint32_t seq_be, uint32_t ackseq_be,
-                 int psh, uint8_t *tcp_payload, size_t tcp_payload_size)
+                 int psh, size_t tcp_payload_size, uint32_t tcp_payload_sum)
 {
-    size_t pkt_len;
+    size_t hdr_len;
+    uint32_t sum;
     struct ip6_hdr *ip6h;
     struct tcphdr *tcph;
-    uint8_t *tcppl;
     struct sockaddr_in6 *saddr_in6, *daddr_in6;
 
     if (saddr->sa_family != AF_INET6 || daddr->sa_family != AF_INET6) {
@@ -106,15 +124,19 @@ int fh_pkt6_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
     saddr_in6 = (struct sockaddr_in6 *) saddr;
     daddr_in6 = (struct sockaddr_in6 *) daddr;
 
-    pkt_len = sizeof(*ip6h) + sizeof(*tcph) + tcp_payload_size;
-    if (buffer_size < pkt_len + 1) {
+    hdr_len = sizeof(*ip6h) + sizeof(*tcph);
+    if (buffer_size < hdr_len) {
         E("ERROR: %s", strerror(ENOBUFS));
         return -1;
     }
 
+    if (sizeof(*tcph) + tcp_payload_size > UINT16_MAX) {
+        E("ERROR: %s", strerror(EMSGSIZE));
+        return -1;
+    }
+
     ip6h = (struct ip6_hdr *) buffer;
     tcph = (struct tcphdr *) (buffer + sizeof(*ip6h));
-    tcppl = buffer + sizeof(*ip6h) + sizeof(*tcph);
 
     memset(ip6h, 0, sizeof(*ip6h));
     ip6h->ip6_flow = htonl((6 << 28) /* version */ | (0 << 20) /* traffic */ |
@@ -137,11 +159,12 @@ int fh_pkt6_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
     tcph->check = 0;
     tcph->urg_ptr = 0;
 
-    if (tcp_payload_size) {
-        memcpy(tcppl, tcp_payload, tcp_payload_size);
-    }
-
-    nfq_tcp_compute_checksum_ipv6(tcph, ip6h);
+    /* see fh_pkt4_make() */
+    sum = fh_csum_partial(&ip6h->ip6_src, 2 * sizeof(ip6h->ip6_src),
+                          tcp_payload_sum);
+    sum += htons(IPPROTO_TCP) + htons(sizeof(*tcph) + tcp_payload_size);
+    sum = fh_csum_partial(tcph, sizeof(*tcph), sum);
+    tcph->check = fh_csum_fold(sum);
 
-    return pkt_len;
+    return hdr_len;
 }
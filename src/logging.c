@@ -21,16 +21,261 @@
 #include "logging.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "globvar.h"
 
+/* number of flow records buffered by the ring, must be a power of 2 */
+#define RING_SIZE 4096
+
+/*
+    Flow logs (E_FLOW) are pushed as compact binary records into a bounded
+    lock-free ring (multiple producers, one consumer). A writer thread does
+    the inet_ntop(), timestamp formatting and stdio work, so the queue
+    threads never block on the log file. Records are dropped and counted
+    when the ring is full.
+    The writer sleeps on a futex while the ring is empty and is woken by the
+    first record pushed. Records are consumed under the lock of the log
+    file, so that E() can write out the pending ones before its own line
+    and the log stays in order.
+*/
+struct flow_record {
+    uint32_t seq;
+    uint32_t arg;
+    time_t time;
+    const char *filename;
+    unsigned long line;
+    const char *arrow;
+    sa_family_t family;
+    uint16_t port1_be;
+    uint16_t port2_be;
+    uint8_t addr1[16];
+    uint8_t addr2[16];
+};
+
+static struct flow_record *ring = NULL;
+static uint32_t ring_head = 0;
+static uint32_t ring_tail = 0;
+static unsigned long ring_dropped = 0;
+/* last timestamp formatted by drain_ring(), under the log file lock */
+static time_t ring_last_t = (time_t) -1;
+static char ring_time_buff[32];
+static int writer_waiting = 0;
+static int writer_exit = 0;
+static int writer_started = 0;
+static pthread_t writer;
+
+static void addr_to_str(sa_family_t family, uint8_t *addr,
+                        char ipstr[INET6_ADDRSTRLEN])
+{
+    static const char invalid[] = "INVALID";
+
+    if (!inet_ntop(family, addr, ipstr, INET6_ADDRSTRLEN)) {
+        memcpy(ipstr, invalid, sizeof(invalid));
+    }
+}
+
+
+static void format_time(time_t t, char time_buff[32])
+{
+    struct tm tmi;
+
+    localtime_r(&t, &tmi);
+    strftime(time_buff, 32, "%Y-%m-%d %H:%M:%S", &tmi);
+}
+
+
+static void write_flow(struct flow_record *rec, const char *time_buff)
+{
+    char ip1[INET6_ADDRSTRLEN], ip2[INET6_ADDRSTRLEN];
+
+    addr_to_str(rec->family, rec->addr1, ip1);
+    addr_to_str(rec->family, rec->addr2, ip2);
+
+    fprintf(g_ctx.logfp, "%19s [%13s:%03lu] %s:%u ", time_buff,
+            rec->filename, rec->line, ip1, ntohs(rec->port1_be));
+    fprintf(g_ctx.logfp, rec->arrow, rec->arg);
+    fprintf(g_ctx.logfp, " %s:%u\n", ip2, ntohs(rec->port2_be));
+}
+
+
+/*
+    Tell whether a record is waiting at the tail of the ring.
+*/
+static int ring_pending(void)
+{
+    uint32_t tail, seq;
+
+    tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    seq = __atomic_load_n(&ring[tail & (RING_SIZE - 1)].seq,
+                          __ATOMIC_ACQUIRE);
+
+    return (int32_t) (seq - (tail + 1)) >= 0;
+}
+
+
+static int drain_ring(void)
+{
+    int cnt;
+    uint32_t seq, tail;
+    unsigned long dropped;
+    struct flow_record *rec;
+
+    cnt = 0;
+
+    flockfile(g_ctx.logfp);
+
+    tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &ring[tail & (RING_SIZE - 1)];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if ((int32_t) (seq - (tail + 1)) < 0) {
+            break;
+        }
+
+        /* the same second is only formatted once */
+        if (rec->time != ring_last_t) {
+            ring_last_t = rec->time;
+            format_time(rec->time, ring_time_buff);
+        }
+        write_flow(rec, ring_time_buff);
+
+        __atomic_store_n(&rec->seq, tail + RING_SIZE, __ATOMIC_RELEASE);
+        tail++;
+        __atomic_store_n(&ring_tail, tail, __ATOMIC_RELAXED);
+        cnt++;
+    }
+
+    if (cnt) {
+        fflush(g_ctx.logfp);
+    }
+
+    funlockfile(g_ctx.logfp);
+
+    dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        E("WARNING: %lu log records dropped", dropped);
+    }
+
+    return cnt;
+}
+
+
+/*
+    Wake up the writer if it sleeps. The fence pairs with the one in
+    writer_thread(): either the writer sees the new record (or the exit
+    request), or we see it waiting.
+*/
+static void writer_wake(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&writer_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&writer_waiting, 0, __ATOMIC_RELAXED)) {
+        syscall(SYS_futex, &writer_waiting, FUTEX_WAKE_PRIVATE, 1, NULL,
+                NULL, 0);
+    }
+}
+
+
+static void *writer_thread(void *arg)
+{
+    int stop;
+
+    (void) arg;
+
+    for (;;) {
+        stop = __atomic_load_n(&writer_exit, __ATOMIC_ACQUIRE);
+        if (drain_ring()) {
+            continue;
+        }
+        if (stop) {
+            break;
+        }
+
+        __atomic_store_n(&writer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        /* sleep only if nothing came in before the flag was raised */
+        if (!ring_pending() &&
+            !__atomic_load_n(&writer_exit, __ATOMIC_RELAXED)) {
+            syscall(SYS_futex, &writer_waiting, FUTEX_WAIT_PRIVATE, 1, NULL,
+                    NULL, 0);
+        }
+        __atomic_store_n(&writer_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+static int writer_setup(void)
+{
+    int res;
+    uint32_t i;
+    sigset_t mask, oldmask;
+
+    ring = calloc(RING_SIZE, sizeof(*ring));
+    if (!ring) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < RING_SIZE; i++) {
+        ring[i].seq = i;
+    }
+    ring_head = ring_tail = 0;
+    ring_dropped = 0;
+    ring_last_t = (time_t) -1;
+    writer_waiting = 0;
+    writer_exit = 0;
+
+    /*
+        Signals are handled by the main thread only.
+    */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    res = pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    if (res) {
+        E("ERROR: pthread_sigmask(): %s", strerror(res));
+        goto free_ring;
+    }
+
+    res = pthread_create(&writer, NULL, &writer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (res) {
+        E("ERROR: pthread_create(): %s", strerror(res));
+        goto free_ring;
+    }
+    writer_started = 1;
+
+    return 0;
+
+free_ring:
+    free(ring);
+    ring = NULL;
+
+    return -1;
+}
+
 int fh_logger_setup(void)
 {
+    int res;
+
     if (g_ctx.logpath) {
         g_ctx.logfp = fopen(g_ctx.logpath, "a");
         if (!g_ctx.logfp) {
@@ -42,12 +287,30 @@ int fh_logger_setup(void)
         g_ctx.logfp = stderr;
     }
 
+    if (!g_ctx.silent) {
+        res = writer_setup();
+        if (res < 0) {
+            E(T(writer_setup));
+            return -1;
+        }
+    }
+
     return 0;
 }
 
 
 void fh_logger_cleanup(void)
 {
+    if (writer_started) {
+        __atomic_store_n(&writer_exit, 1, __ATOMIC_RELEASE);
+        writer_wake();
+        pthread_join(writer, NULL);
+        writer_started = 0;
+    }
+
+    free(ring);
+    ring = NULL;
+
     if (g_ctx.logfp && g_ctx.logfp != stderr) {
         fclose(g_ctx.logfp);
         g_ctx.logfp = NULL;
@@ -59,13 +322,17 @@ void fh_logger(const char *funcname, const char *filename, unsigned long line,
                int end, const char *fmt, ...)
 {
     va_list args;
-    time_t t;
     char time_buff[32];
-    struct tm *tmi;
 
-    t = time(NULL);
-    tmi = localtime(&t);
-    strftime(time_buff, sizeof(time_buff), "%Y-%m-%d %H:%M:%S", tmi);
+    format_time(time(NULL), time_buff);
+
+    /* keep lines from concurrent queue threads in one piece */
+    flockfile(g_ctx.logfp);
+
+    /* flow records logged before this line come first */
+    if (writer_started) {
+        drain_ring();
+    }
 
     fprintf(g_ctx.logfp, "%19s [%13s:%03lu] ", time_buff, filename, line);
     va_start(args, fmt);
@@ -78,6 +345,8 @@ void fh_logger(const char *funcname, const char *filename, unsigned long line,
                 filename, line, funcname);
     }
     fflush(g_ctx.logfp);
+
+    funlockfile(g_ctx.logfp);
 }
 
 
@@ -90,3 +359,72 @@ void fh_logger_raw(const char *fmt, ...)
     va_end(args);
     fflush(g_ctx.logfp);
 }
+
+
+void fh_logger_flow(const char *filename, unsigned long line,
+                    const char *arrow, uint32_t arg, struct sockaddr *addr1,
+                    uint16_t port1_be, struct sockaddr *addr2,
+                    uint16_t port2_be)
+{
+    uint32_t pos, seq;
+    int32_t diff;
+    char time_buff[32];
+    struct flow_record *rec, sync_rec;
+
+    if (writer_started) {
+        /*
+            Claim a slot. A slot is free when its sequence number equals the
+            position; it is still unread one lap behind.
+        */
+        pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        for (;;) {
+            rec = &ring[pos & (RING_SIZE - 1)];
+            seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+            diff = (int32_t) (seq - pos);
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                __atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+                return;
+            } else {
+                pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+            }
+        }
+    } else {
+        rec = &sync_rec;
+    }
+
+    rec->arg = arg;
+    rec->time = time(NULL);
+    rec->filename = filename;
+    rec->line = line;
+    rec->arrow = arrow;
+    rec->family = addr1->sa_family;
+    rec->port1_be = port1_be;
+    rec->port2_be = port2_be;
+
+    if (addr1->sa_family == AF_INET6) {
+        memcpy(rec->addr1, &((struct sockaddr_in6 *) addr1)->sin6_addr, 16);
+        memcpy(rec->addr2, &((struct sockaddr_in6 *) addr2)->sin6_addr, 16);
+    } else {
+        memcpy(rec->addr1, &((struct sockaddr_in *) addr1)->sin_addr, 4);
+        memcpy(rec->addr2, &((struct sockaddr_in *) addr2)->sin_addr, 4);
+    }
+
+    if (writer_started) {
+        __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+        writer_wake();
+        return;
+    }
+
+    format_time(rec->time, time_buff);
+
+    flockfile(g_ctx.logfp);
+    write_flow(rec, time_buff);
+    fflush(g_ctx.logfp);
+    funlockfile(g_ctx.logfp);
+}
@@ -21,12 +21,12 @@
 #include "mainfun.h"
 
 #include <errno.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
 #include <net/if.h>
 #include <sys/resource.h>
@@ -37,11 +37,12 @@
 #include "nfqueue.h"
 #include "nfrules.h"
 #include "payload.h"
+#include "prng.h"
 #include "process.h"
 #include "rawsend.h"
 #include "signals.h"
-#include "srcinfo.h"
 #include "conntrack.h"
+#include "csum.h"
 
 #ifndef PROGNAME
 #define PROGNAME "fakehttp"
@@ -51,6 +52,14 @@
 #define VERSION "dev"
 #endif /* VERSION */
 
+/* long-only options */
+#define OPT_SEED 256
+#define OPT_TX_RING 257
+#define OPT_QDISC_BYPASS 258
+#define OPT_IO_URING 259
+#define OPT_XDP 260
+#define OPT_FLOW_TIMEOUT 261
+
 static void print_usage(const char *name)
 {
     static const char *usage_fmt =
@@ -84,14 +93,26 @@ static void print_usage(const char *name)
         "  -f                 skip firewall rules\n"
         "  -g                 disable hop count estimation\n"
         "  -m <mark>          fwmark for bypassing the queue\n"
-        "  -n <number>        netfilter queue number\n"
+        "  -N <number>        flow table size (default: 4096)\n"
+        "  -n <from>[-<to>]   netfilter queue number, or a range of queues "
+        "(one thread each)\n"
         "  -r <repeat>        duplicate generated packets for <repeat> times\n"
-        "  -T <number>        conntrack packet threshold (default: 100)\n"
+        "  -T <number>        send fakes once per direction, at its "
+        "<number>th packet\n"
+        "                     (2 or more, default: 100), uses the queue after "
+        "-n\n"
         "  -t <ttl>           TTL for generated packets\n"
         "  -x <mask>          set the mask for fwmark\n"
         "  -y <pct>           raise TTL dynamically to <pct>%% of estimated "
         "hops\n"
         "  -z                 use iptables commands instead of nft\n"
+        "  --seed <number>    fixed random seed, for reproducible runs\n"
+        "  --tx-ring          send through a mmap'd PACKET_TX_RING\n"
+        "  --qdisc-bypass     bypass the qdisc layer when sending\n"
+        "  --io-uring         use io_uring for packets and verdicts\n"
+        "  --xdp              send through AF_XDP sockets (copy mode)\n"
+        "  --flow-timeout <seconds>\n"
+        "                     idle timeout of tracked flows (default: 300)\n"
         "\n"
         "FakeHTTP version " VERSION "\n";
 
@@ -102,9 +123,18 @@ static void print_usage(const char *name)
 int main(int argc, char *argv[])
 {
     unsigned long long tmp;
+    char *endptr;
     int res, opt, exitcode;
     size_t plinfo_cap, iface_cap, plinfo_cnt, iface_cnt;
     const char *iface_info, *direction_info, *ipproto_info;
+    static const struct option long_opts[] = {
+        {"seed", required_argument, NULL, OPT_SEED},
+        {"tx-ring", no_argument, NULL, OPT_TX_RING},
+        {"qdisc-bypass", no_argument, NULL, OPT_QDISC_BYPASS},
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"xdp", no_argument, NULL, OPT_XDP},
+        {"flow-timeout", required_argument, NULL, OPT_FLOW_TIMEOUT},
+        {NULL, 0, NULL, 0}};
 
     exitcode = EXIT_FAILURE;
 
@@ -132,8 +162,9 @@ int main(int argc, char *argv[])
 
     plinfo_cnt = iface_cnt = 0;
 
-    while ((opt = getopt(argc, argv,
-                         "0146ab:c:C:de:fFgh:i:km:n:r:sT:t:vw:x:y:z")) != -1) {
+    while ((opt = getopt_long(argc, argv,
+                              "0146ab:c:C:de:fFgh:i:km:N:n:r:sT:t:vw:x:y:z",
+                              long_opts, NULL)) != -1) {
         switch (opt) {
             case '0':
                 g_ctx.inbound = 1;
@@ -262,19 +293,43 @@ int main(int argc, char *argv[])
                 g_ctx.fwmark = tmp;
                 break;
 
-            case 'n':
+            case 'N':
                 tmp = strtoull(optarg, NULL, 0);
-                if (!tmp || tmp > UINT32_MAX) {
+                if (!tmp || tmp > FH_CONNTRACK_MAX) {
+                    fprintf(stderr, "%s: invalid value for -N.\n", argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                g_ctx.conntrack_size = tmp;
+                break;
+
+            case 'n':
+                tmp = strtoull(optarg, &endptr, 0);
+                if (!tmp || tmp > UINT16_MAX) {
                     fprintf(stderr, "%s: invalid value for -n.\n", argv[0]);
                     print_usage(argv[0]);
                     goto free_mem;
                 }
                 g_ctx.nfqnum = tmp;
+                g_ctx.nfqcnt = 1;
+
+                /* -n <first>-<last>: one worker thread per queue */
+                if (*endptr == '-') {
+                    tmp = strtoull(endptr + 1, NULL, 0);
+                    if (tmp < g_ctx.nfqnum || tmp > UINT16_MAX ||
+                        tmp - g_ctx.nfqnum >= FH_NFQ_MAX) {
+                        fprintf(stderr, "%s: invalid value for -n.\n",
+                                argv[0]);
+                        print_usage(argv[0]);
+                        goto free_mem;
+                    }
+                    g_ctx.nfqcnt = tmp - g_ctx.nfqnum + 1;
+                }
                 break;
 
             case 'r':
                 tmp = strtoull(optarg, NULL, 0);
-                if (!tmp || tmp > 10) {
+                if (!tmp || tmp > FH_RAWSEND_REPEAT_MAX) {
                     fprintf(stderr, "%s: invalid value for -r.\n", argv[0]);
                     print_usage(argv[0]);
                     goto free_mem;
@@ -288,7 +343,8 @@ int main(int argc, char *argv[])
 
             case 'T':
                 tmp = strtoull(optarg, NULL, 0);
-                if (!tmp || tmp > UINT32_MAX) {
+                /* the first packet of each direction is the handshake */
+                if (tmp < 2 || tmp > UINT32_MAX) {
                     fprintf(stderr, "%s: invalid value for -T.\n", argv[0]);
                     print_usage(argv[0]);
                     goto free_mem;
@@ -396,6 +452,45 @@ int main(int argc, char *argv[])
                 g_ctx.use_iptables = 1;
                 break;
 
+            case OPT_SEED:
+                tmp = strtoull(optarg, &endptr, 0);
+                if (!*optarg || *endptr) {
+                    fprintf(stderr, "%s: invalid value for --seed.\n",
+                            argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                g_ctx.seed = tmp;
+                g_ctx.use_seed = 1;
+                break;
+
+            case OPT_TX_RING:
+                g_ctx.tx_ring = 1;
+                break;
+
+            case OPT_QDISC_BYPASS:
+                g_ctx.qdisc_bypass = 1;
+                break;
+
+            case OPT_IO_URING:
+                g_ctx.use_uring = 1;
+                break;
+
+            case OPT_XDP:
+                g_ctx.use_xdp = 1;
+                break;
+
+            case OPT_FLOW_TIMEOUT:
+                tmp = strtoull(optarg, NULL, 0);
+                if (!tmp || tmp > FH_CONNTRACK_TIMEOUT_MAX) {
+                    fprintf(stderr, "%s: invalid value for --flow-timeout.\n",
+                            argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                g_ctx.flow_timeout = tmp;
+                break;
+
             default:
                 print_usage(argv[0]);
                 goto free_mem;
@@ -422,6 +517,14 @@ int main(int argc, char *argv[])
         g_ctx.use_ipv4 = g_ctx.use_ipv6 = 1;
     }
 
+    /* packets selected by the kernel-side -T rules use the next queue */
+    g_ctx.thr_nfqnum = g_ctx.nfqnum + g_ctx.nfqcnt;
+    if (g_ctx.thr_nfqnum > UINT16_MAX) {
+        fprintf(stderr, "%s: invalid value for -n.\n", argv[0]);
+        print_usage(argv[0]);
+        goto free_mem;
+    }
+
     if (!g_ctx.fwmask) {
         g_ctx.fwmask = g_ctx.fwmark;
     } else if ((g_ctx.fwmark & g_ctx.fwmask) != g_ctx.fwmark) {
@@ -462,8 +565,6 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand(time(NULL));
-
     res = fh_logger_setup();
     if (res < 0) {
         EE(T(fh_logger_setup));
@@ -478,25 +579,30 @@ int main(int argc, char *argv[])
     E("Home page: https://github.com/MikeWang000000/FakeHTTP");
     E("");
 
-    res = fh_payload_setup();
+    res = fh_prng_setup();
     if (res < 0) {
-        EE(T(fh_payload_setup));
+        EE(T(fh_prng_setup));
         goto cleanup_logger;
     }
 
-    res = fh_srcinfo_setup();
+    fh_csum_setup();
+    E("checksum routine: %s", fh_csum_name());
+
+    res = fh_payload_setup();
     if (res < 0) {
-        EE(T(fh_srcinfo_setup));
-        goto cleanup_payload;
+        EE(T(fh_payload_setup));
+        goto cleanup_logger;
     }
 
     res = fh_conntrack_setup();
     if (res < 0) {
         EE(T(fh_conntrack_setup));
-        goto cleanup_srcinfo;
+        goto cleanup_payload;
     }
 
-    E("conntrack packet threshold set to %" PRIu32, g_ctx.packet_threshold);
+    E("conntrack packet threshold set to %" PRIu32
+      " (netfilter queue number %" PRIu32 ")",
+      g_ctx.packet_threshold, g_ctx.thr_nfqnum);
 
     res = fh_rawsend_setup();
     if (res < 0) {
@@ -551,8 +657,15 @@ int main(int argc, char *argv[])
         direction_info = "";
     }
 
-    E("listening on %s%s%s, netfilter queue number %" PRIu32 "...", iface_info,
-      ipproto_info, direction_info, g_ctx.nfqnum);
+    if (g_ctx.nfqcnt > 1) {
+        E("listening on %s%s%s, netfilter queue number %" PRIu32 "-%" PRIu32
+          " (%" PRIu32 " threads)...",
+          iface_info, ipproto_info, direction_info, g_ctx.nfqnum,
+          g_ctx.nfqnum + g_ctx.nfqcnt - 1, g_ctx.nfqcnt);
+    } else {
+        E("listening on %s%s%s, netfilter queue number %" PRIu32 "...",
+          iface_info, ipproto_info, direction_info, g_ctx.nfqnum);
+    }
 
     /*
         Main Loop
@@ -578,9 +691,6 @@ cleanup_rawsend:
 cleanup_conntrack:
     fh_conntrack_cleanup();
 
-cleanup_srcinfo:
-    fh_srcinfo_cleanup();
-
 cleanup_payload:
     fh_payload_cleanup();
 
@@ -21,27 +21,173 @@
 #include "nfqueue.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/if_packet.h>
 #include <linux/netfilter.h>
+#include <linux/netlink.h>
 #include <linux/netfilter/nfnetlink_queue.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
 
+#include "conntrack.h"
 #include "globvar.h"
 #include "logging.h"
+#include "prng.h"
 #include "rawsend.h"
 #include "signals.h"
+#include "uring.h"
+
+#define BUFFSIZE UINT16_MAX
+
+/* max number of netlink messages taken per recvmmsg() call */
+#define BATCHSIZE 8
+
+/* copy range of the threshold queue: enough for IPv4/IPv6 + TCP headers */
+#define HDR_COPYSIZE 128
+
+/* io_uring: submission queue size, and user_data of the requests */
+#define URING_ENTRIES (4 * BATCHSIZE)
+#define URING_RECV 1
+#define URING_VERDICT 2
+
+/* a verdict message, not counting the packet of a modified one */
+#define VERDICT_HDRSIZE 128
+
+/*
+    Verdict messages queued for one batch: at most a verdict and a batched
+    ACCEPT per packet plus the final ACCEPT, and a copy of every modified
+    packet.
+*/
+#define VBUFFSIZE                                                      \
+    ((size_t) (2 * BATCHSIZE + 1) * VERDICT_HDRSIZE +                  \
+     (size_t) BATCHSIZE * BUFFSIZE)
+
+struct nfq_worker {
+    uint32_t num;
+    int thr_hit;
+    int fd;
+    struct nfq_handle *h;
+    struct nfq_q_handle *qh;
+    char *buff;
+    struct mmsghdr msgs[BATCHSIZE];
+    struct iovec iovs[BATCHSIZE];
+    uint32_t accept_id;
+    int accept_pending;
+    struct fh_uring *ring;
+    char *vbuff;
+    size_t vbuff_used;
+    uint32_t vinflight;
+    pthread_t thread;
+    int started;
+};
+
+static struct nfq_worker *workers = NULL;
+static uint32_t workers_cnt = 0;
+
+/*
+    With io_uring, verdicts are not sent right away. They are queued as
+    linked sends, which go out in order with the next io_uring_enter(), the
+    same call that waits for the next packets.
+*/
+static int queue_verdict(struct nfq_worker *w, int type, uint32_t id,
+                         uint32_t verdict, uint32_t len,
+                         const unsigned char *data)
+{
+    int res;
+    char *buf;
+    struct nlmsghdr *nlh;
+
+    if (w->vbuff_used + VERDICT_HDRSIZE + len > VBUFFSIZE) {
+        E("ERROR: verdict buffer full");
+        return -1;
+    }
+
+    /*
+        Out of submission entries: push the sends queued so far now. The
+        kernel issues them in order within this call, so the verdicts still
+        go out in order.
+    */
+    if (!fh_uring_space(w->ring)) {
+        res = fh_uring_submit_wait(w->ring, 0);
+        if (res < 0) {
+            E("ERROR: io_uring_enter(): %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    buf = w->vbuff + w->vbuff_used;
+    memset(buf, 0, VERDICT_HDRSIZE);
+
+    nlh = nfq_nlmsg_put(buf, type, w->num);
+    nfq_nlmsg_verdict_put(nlh, id, verdict);
+    if (data) {
+        nfq_nlmsg_verdict_put_pkt(nlh, data, len);
+    }
+
+    res = fh_uring_send(w->ring, w->fd, buf, nlh->nlmsg_len, 1,
+                        URING_VERDICT);
+    if (res < 0) {
+        E("ERROR: fh_uring_send(): %s", strerror(errno));
+        return -1;
+    }
+
+    w->vbuff_used += NLMSG_ALIGN(nlh->nlmsg_len);
+    w->vinflight++;
+
+    return 0;
+}
+
+
+static int set_verdict(struct nfq_worker *w, uint32_t id, uint32_t verdict,
+                       uint32_t len, const unsigned char *data)
+{
+    if (w->ring) {
+        return queue_verdict(w, NFQNL_MSG_VERDICT, id, verdict, len, data);
+    }
+
+    return nfq_set_verdict(w->qh, id, verdict, len, data);
+}
+
+
+/*
+    Plain ACCEPT verdicts are not sent right away. They are coalesced and
+    issued with a single nfq_set_verdict_batch() at the end of each receive
+    batch, which accepts every pending packet up to the given id.
+*/
+static int flush_accepts(struct nfq_worker *w)
+{
+    int res;
+
+    if (!w->accept_pending) {
+        return 0;
+    }
+    w->accept_pending = 0;
+
+    if (w->ring) {
+        return queue_verdict(w, NFQNL_MSG_VERDICT_BATCH, w->accept_id,
+                             NF_ACCEPT, 0, NULL);
+    }
+
+    res = nfq_set_verdict_batch(w->qh, w->accept_id, NF_ACCEPT);
+    if (res < 0) {
+        E("ERROR: nfq_set_verdict_batch(): %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
 
-static int fd = -1;
-static struct nfq_handle *h = NULL;
-static struct nfq_q_handle *qh = NULL;
 
 static int callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
                     struct nfq_data *nfa, void *data)
@@ -52,9 +198,12 @@ static int callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
     unsigned char *pkt_data;
     struct nfqnl_msg_packet_hw *hwph;
     struct sockaddr_ll sll;
+    struct nfq_worker *w;
 
+    (void) qh;
     (void) nfmsg;
-    (void) data;
+
+    w = data;
 
     ph = nfq_get_msg_packet_hdr(nfa);
     if (!ph) {
@@ -98,31 +247,89 @@ static int callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
         memset(sll.sll_addr, 0, sizeof(sll.sll_addr));
     }
 
-    verdict = fh_rawsend_handle(&sll, pkt_data, pkt_len, &modified);
+    verdict = fh_rawsend_handle(&sll, pkt_data, pkt_len, w->thr_hit,
+                                &modified);
     if (verdict < 0) {
         EE(T(fh_rawsend_handle));
         goto ret_accept;
     }
 
+    if (verdict == NF_ACCEPT && !modified) {
+        goto ret_accept;
+    }
+
+    /*
+        DROP and modified packets are flushed individually, after all the
+        earlier ACCEPTs so that the verdict order is preserved.
+    */
+    flush_accepts(w);
+
     if (modified && verdict != NF_DROP) {
-        return nfq_set_verdict(qh, pkt_id, verdict, pkt_len, pkt_data);
+        return set_verdict(w, pkt_id, verdict, pkt_len, pkt_data);
     }
 
-    return nfq_set_verdict(qh, pkt_id, verdict, 0, NULL);
+    return set_verdict(w, pkt_id, verdict, 0, NULL);
 
 ret_accept:
-    return nfq_set_verdict(qh, pkt_id, NF_ACCEPT, 0, NULL);
+    w->accept_id = pkt_id;
+    w->accept_pending = 1;
+    return 0;
 }
 
 
-int fh_nfq_setup(void)
+static int uring_setup(struct nfq_worker *w)
+{
+    int res;
+
+    w->ring = fh_uring_create(URING_ENTRIES);
+    if (!w->ring) {
+        E(T(fh_uring_create));
+        return -1;
+    }
+
+    /* the receive buffers of recvmmsg() become the provided buffers */
+    res = fh_uring_provide_bufs(w->ring, w->buff, BUFFSIZE, BATCHSIZE);
+    if (res < 0) {
+        E(T(fh_uring_provide_bufs));
+        goto destroy_ring;
+    }
+
+    w->vbuff = malloc(VBUFFSIZE);
+    if (!w->vbuff) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        goto destroy_ring;
+    }
+    w->vbuff_used = 0;
+    w->vinflight = 0;
+
+    return 0;
+
+destroy_ring:
+    fh_uring_destroy(w->ring);
+    w->ring = NULL;
+
+    return -1;
+}
+
+
+static void uring_cleanup(struct nfq_worker *w)
+{
+    fh_uring_destroy(w->ring);
+    w->ring = NULL;
+
+    free(w->vbuff);
+    w->vbuff = NULL;
+}
+
+
+static int queue_setup(struct nfq_worker *w)
 {
-    int res, opt;
+    int res, opt, i;
     char *err_hint;
     socklen_t opt_len;
 
-    h = nfq_open();
-    if (!h) {
+    w->h = nfq_open();
+    if (!w->h) {
         switch (errno) {
             case EPERM:
                 err_hint = " (Are you root?)";
@@ -137,8 +344,8 @@ int fh_nfq_setup(void)
         return -1;
     }
 
-    qh = nfq_create_queue(h, g_ctx.nfqnum, &callback, NULL);
-    if (!qh) {
+    w->qh = nfq_create_queue(w->h, w->num, &callback, w);
+    if (!w->qh) {
         switch (errno) {
             case EPERM:
                 res = fh_kill_running(0);
@@ -155,27 +362,36 @@ int fh_nfq_setup(void)
             default:
                 err_hint = "";
         }
-        E("ERROR: nfq_create_queue(): %s%s", strerror(errno), err_hint);
+        E("ERROR: nfq_create_queue(): %" PRIu32 ": %s%s", w->num,
+          strerror(errno), err_hint);
         goto close_nfq;
     }
 
-    res = nfq_set_mode(qh, NFQNL_COPY_PACKET, 0xffff);
+    /*
+        Packets on the threshold queue are never modified or re-sent, and
+        only their headers are read, so there is no need to copy the payload
+        to userspace. The other queues carry SYNs whose TFO option may be
+        rewritten, so they still get the full packet.
+    */
+    res = nfq_set_mode(w->qh, NFQNL_COPY_PACKET,
+                       w->thr_hit ? HDR_COPYSIZE : 0xffff);
     if (res < 0) {
         E("ERROR: nfq_set_mode(): NFQNL_COPY_PACKET: %s", strerror(errno));
         goto destroy_queue;
     }
 
-    res = nfq_set_queue_flags(qh, NFQA_CFG_F_FAIL_OPEN, NFQA_CFG_F_FAIL_OPEN);
+    res = nfq_set_queue_flags(w->qh, NFQA_CFG_F_FAIL_OPEN,
+                              NFQA_CFG_F_FAIL_OPEN);
     if (res < 0) {
         E("ERROR: nfq_set_queue_flags(): NFQA_CFG_F_FAIL_OPEN: %s",
           strerror(errno));
         goto destroy_queue;
     }
 
-    fd = nfq_fd(h);
+    w->fd = nfq_fd(w->h);
 
     opt_len = sizeof(opt);
-    res = getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, &opt_len);
+    res = getsockopt(w->fd, SOL_SOCKET, SO_RCVBUF, &opt, &opt_len);
     if (res < 0) {
         E("ERROR: getsockopt(): SO_RCVBUF: %s", strerror(errno));
         goto destroy_queue;
@@ -183,52 +399,222 @@ int fh_nfq_setup(void)
 
     if (opt < 1048576 /* 1 MB */) {
         opt = 1048576;
-        res = setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &opt, sizeof(opt));
+        res = setsockopt(w->fd, SOL_SOCKET, SO_RCVBUFFORCE, &opt,
+                         sizeof(opt));
         if (res < 0) {
             E("ERROR: setsockopt(): SO_RCVBUFFORCE: %s", strerror(errno));
             goto destroy_queue;
         }
     }
 
+    w->buff = malloc((size_t) BUFFSIZE * BATCHSIZE);
+    if (!w->buff) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        goto destroy_queue;
+    }
+
+    memset(w->msgs, 0, sizeof(w->msgs));
+    for (i = 0; i < BATCHSIZE; i++) {
+        w->iovs[i].iov_base = w->buff + (size_t) BUFFSIZE * i;
+        w->iovs[i].iov_len = BUFFSIZE;
+        w->msgs[i].msg_hdr.msg_iov = &w->iovs[i];
+        w->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    w->accept_pending = 0;
+
+    if (g_ctx.use_uring) {
+        res = uring_setup(w);
+        if (res < 0) {
+            E(T(uring_setup));
+            E("WARNING: io_uring unavailable, queue %" PRIu32
+              " uses recvmmsg()",
+              w->num);
+        }
+    }
+
     return 0;
 
 destroy_queue:
-    nfq_destroy_queue(qh);
+    nfq_destroy_queue(w->qh);
+    w->qh = NULL;
 
 close_nfq:
-    nfq_close(h);
+    nfq_close(w->h);
+    w->h = NULL;
+    w->fd = -1;
 
     return -1;
 }
 
 
-void fh_nfq_cleanup(void)
+static void queue_cleanup(struct nfq_worker *w)
 {
-    if (qh) {
-        nfq_destroy_queue(qh);
-        qh = NULL;
+    uring_cleanup(w);
+
+    if (w->qh) {
+        nfq_destroy_queue(w->qh);
+        w->qh = NULL;
     }
 
-    if (h) {
-        nfq_close(h);
-        h = NULL;
-        fd = -1;
+    if (w->h) {
+        nfq_close(w->h);
+        w->h = NULL;
+        w->fd = -1;
     }
+
+    free(w->buff);
+    w->buff = NULL;
 }
 
 
-int fh_nfq_loop(void)
+/*
+    Receive loop on io_uring: a multishot receive stays armed on the netlink
+    socket, and each io_uring_enter() both sends the verdicts of the last
+    batch and waits for the next packets.
+    Returns 1 if the kernel turns out not to support multishot receives.
+*/
+static int queue_loop_uring(struct nfq_worker *w)
 {
-    static const size_t buffsize = UINT16_MAX;
+    int res, err_cnt, armed, received;
+    char *buf;
+    uint32_t i, recv_cnt;
+    struct fh_uring_cqe cqe, recvs[BATCHSIZE];
 
-    int res, ret, err_cnt;
-    ssize_t recv_len;
-    char *buff;
+    err_cnt = armed = received = 0;
+    recv_cnt = 0;
 
-    buff = malloc(buffsize);
-    if (!buff) {
-        E("ERROR: malloc(): %s", strerror(errno));
-        return -1;
+    while (!g_ctx.exit) {
+        if (err_cnt >= 20) {
+            E("too many errors, exiting...");
+            return -1;
+        }
+
+        if (!armed) {
+            res = fh_uring_recv_multishot(w->ring, w->fd, URING_RECV);
+            if (res < 0) {
+                E("ERROR: fh_uring_recv_multishot(): %s", strerror(errno));
+                return -1;
+            }
+            armed = 1;
+        }
+
+        /*
+            io_uring_enter() is not a cancellation point, so the worker is
+            cancelled asynchronously, and only while blocking in there.
+        */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+        res = fh_uring_submit_wait(w->ring, 1);
+        pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (res < 0) {
+            switch (errno) {
+                case EINTR:
+                    continue;
+                case EAGAIN:
+                case EBUSY:
+                    err_cnt++;
+                    E("ERROR: io_uring_enter(): %s", strerror(errno));
+                    continue;
+                default:
+                    E("ERROR: io_uring_enter(): %s", strerror(errno));
+                    return -1;
+            }
+        }
+
+        fh_conntrack_tick();
+
+        while (fh_uring_get_cqe(w->ring, &cqe)) {
+            if (cqe.user_data == URING_VERDICT) {
+                w->vinflight--;
+                if (cqe.res < 0) {
+                    err_cnt++;
+                    E("ERROR: send(): %s", strerror(-cqe.res));
+                }
+                continue;
+            }
+
+            if (!fh_uring_more(cqe.flags)) {
+                armed = 0;
+            }
+
+            if (cqe.res < 0) {
+                if (cqe.res == -EINVAL && !received) {
+                    return 1;
+                }
+                switch (-cqe.res) {
+                    case ENOBUFS:
+                        /*
+                            All the provided buffers are taken: a burst
+                            larger than the ring, not a failure. The receive
+                            is armed again once they are handed back.
+                        */
+                        continue;
+                    case EINTR:
+                    case EAGAIN:
+                        err_cnt++;
+                        E("ERROR: recv(): %s", strerror(-cqe.res));
+                        continue;
+                    default:
+                        E("ERROR: recv(): %s", strerror(-cqe.res));
+                        return -1;
+                }
+            }
+
+            /* every buffer is taken back before it is handed out again */
+            received = 1;
+            recvs[recv_cnt++] = cqe;
+        }
+
+        /*
+            Packets are only handled once all the verdicts sent so far are
+            done with, so that their buffer can be reused.
+        */
+        if (w->vinflight) {
+            continue;
+        }
+        w->vbuff_used = 0;
+
+        for (i = 0; i < recv_cnt; i++) {
+            buf = fh_uring_buf(w->ring, recvs[i].flags);
+            res = nfq_handle_packet(w->h, buf, recvs[i].res);
+            fh_uring_put_buf(w->ring, recvs[i].flags);
+            if (res < 0) {
+                err_cnt++;
+                E("ERROR: nfq_handle_packet(): %s", "failure");
+                continue;
+            }
+            err_cnt = 0;
+        }
+        recv_cnt = 0;
+
+        res = flush_accepts(w);
+        if (res < 0) {
+            err_cnt++;
+        }
+    }
+
+    return 0;
+}
+
+
+static int queue_loop(struct nfq_worker *w)
+{
+    int res, err_cnt, i, msg_cnt;
+
+    /* the random stream of a queue depends on its number only */
+    th_prng_seed(w->num);
+
+    if (w->ring) {
+        res = queue_loop_uring(w);
+        if (res <= 0) {
+            return res;
+        }
+        E("WARNING: multishot recv unsupported, queue %" PRIu32
+          " uses recvmmsg()",
+          w->num);
+        uring_cleanup(w);
     }
 
     err_cnt = 0;
@@ -236,12 +622,18 @@ int fh_nfq_loop(void)
     while (!g_ctx.exit) {
         if (err_cnt >= 20) {
             E("too many errors, exiting...");
-            ret = -1;
-            goto free_buff;
+            return -1;
         }
 
-        recv_len = recv(fd, buff, buffsize, 0);
-        if (recv_len < 0) {
+        /*
+            Worker threads are only cancelled while blocking in recvmmsg(),
+            never halfway through a batch.
+        */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        msg_cnt = recvmmsg(w->fd, w->msgs, BATCHSIZE, MSG_WAITFORONE, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (msg_cnt < 0) {
             err_cnt++;
             switch (errno) {
                 case EINTR:
@@ -249,29 +641,176 @@ int fh_nfq_loop(void)
                 case EAGAIN:
                 case ETIMEDOUT:
                 case ENOBUFS:
-                    E("ERROR: recv(): %s", strerror(errno));
+                    E("ERROR: recvmmsg(): %s", strerror(errno));
                     continue;
                 default:
-                    E("ERROR: recv(): %s", strerror(errno));
-                    ret = -1;
-                    goto free_buff;
+                    E("ERROR: recvmmsg(): %s", strerror(errno));
+                    return -1;
+            }
+        }
+
+        fh_conntrack_tick();
+
+        for (i = 0; i < msg_cnt; i++) {
+            res = nfq_handle_packet(w->h, w->iovs[i].iov_base,
+                                    w->msgs[i].msg_len);
+            if (res < 0) {
+                err_cnt++;
+                E("ERROR: nfq_handle_packet(): %s", "failure");
+                continue;
             }
+            err_cnt = 0;
         }
 
-        res = nfq_handle_packet(h, buff, recv_len);
+        res = flush_accepts(w);
         if (res < 0) {
             err_cnt++;
-            E("ERROR: nfq_handle_packet(): %s", "failure");
-            continue;
         }
+    }
+
+    return 0;
+}
+
+
+static void *worker_thread(void *arg)
+{
+    int res;
+    struct nfq_worker *w;
+
+    w = arg;
+
+    res = queue_loop(w);
+    if (res < 0) {
+        EE(T(queue_loop));
+        /*
+            Wake up the main thread, which is the only one not blocking
+            SIGTERM, so that the whole process exits.
+        */
+        g_ctx.exit = 1;
+        kill(getpid(), SIGTERM);
+    }
+
+    return NULL;
+}
+
+
+int fh_nfq_setup(void)
+{
+    int res;
+    uint32_t i;
+
+    /*
+        One worker per queue in the -n range, plus one for the queue that
+        receives the packets selected by the kernel-side -T rules.
+    */
+    workers_cnt = g_ctx.nfqcnt + 1;
+    workers = calloc(workers_cnt, sizeof(*workers));
+    if (!workers) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < workers_cnt; i++) {
+        if (i < g_ctx.nfqcnt) {
+            workers[i].num = g_ctx.nfqnum + i;
+            workers[i].thr_hit = 0;
+        } else {
+            workers[i].num = g_ctx.thr_nfqnum;
+            workers[i].thr_hit = 1;
+        }
+        workers[i].fd = -1;
 
-        err_cnt = 0;
+        res = queue_setup(&workers[i]);
+        if (res < 0) {
+            E(T(queue_setup));
+            goto cleanup;
+        }
+    }
+
+    return 0;
+
+cleanup:
+    fh_nfq_cleanup();
+
+    return -1;
+}
+
+
+void fh_nfq_cleanup(void)
+{
+    uint32_t i;
+
+    if (!workers) {
+        return;
+    }
+
+    for (i = 0; i < workers_cnt; i++) {
+        queue_cleanup(&workers[i]);
+    }
+
+    free(workers);
+    workers = NULL;
+    workers_cnt = 0;
+}
+
+
+int fh_nfq_loop(void)
+{
+    int res, ret;
+    uint32_t i;
+    sigset_t mask, oldmask;
+
+    /*
+        Queue 0 is served by the calling thread. Every other queue gets a
+        worker thread, started with SIGINT and SIGTERM blocked so that the
+        signals always interrupt the main thread.
+    */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    res = pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    if (res) {
+        E("ERROR: pthread_sigmask(): %s", strerror(res));
+        return -1;
     }
 
     ret = 0;
 
-free_buff:
-    free(buff);
+    for (i = 1; i < workers_cnt; i++) {
+        res = pthread_create(&workers[i].thread, NULL, &worker_thread,
+                             &workers[i]);
+        if (res) {
+            E("ERROR: pthread_create(): %s", strerror(res));
+            ret = -1;
+            break;
+        }
+        workers[i].started = 1;
+    }
+
+    res = pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (res) {
+        E("ERROR: pthread_sigmask(): %s", strerror(res));
+        ret = -1;
+    }
+
+    if (!ret) {
+        ret = queue_loop(&workers[0]);
+        if (ret < 0) {
+            E(T(queue_loop));
+        }
+    }
+
+    g_ctx.exit = 1;
+
+    for (i = 1; i < workers_cnt; i++) {
+        if (!workers[i].started) {
+            continue;
+        }
+        pthread_cancel(workers[i].thread);
+        pthread_join(workers[i].thread, NULL);
+        workers[i].started = 0;
+    }
 
     return ret;
 }
@@ -20,6 +20,8 @@
 #define _GNU_SOURCE
 #include "nfrules.h"
 
+#include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "globvar.h"
@@ -53,6 +55,12 @@ int fh_nfrules_setup(void)
         g_ctx.use_iptables = 1;
     }
 
+    /*
+        Cleared by the family setups if a packet threshold rule cannot be
+        added; userspace counting then takes over.
+    */
+    g_ctx.thr_kernel = 1;
+
     if (g_ctx.use_iptables) {
         if (g_ctx.use_ipv4) {
             res = fh_ipt4_setup();
@@ -115,3 +123,27 @@ void fh_nfrules_cleanup(void)
         }
     }
 }
+
+
+/*
+    Queue number for the generated rules: "512", or "512-527" (nft) and
+    "512:527" (iptables) when multiple queues are in use.
+*/
+int fh_nfrules_nfqstr(char *buff, size_t size, char sep)
+{
+    int res;
+
+    if (g_ctx.nfqcnt > 1) {
+        res = snprintf(buff, size, "%" PRIu32 "%c%" PRIu32, g_ctx.nfqnum, sep,
+                       g_ctx.nfqnum + g_ctx.nfqcnt - 1);
+    } else {
+        res = snprintf(buff, size, "%" PRIu32, g_ctx.nfqnum);
+    }
+
+    if (res < 0 || (size_t) res >= size) {
+        E("ERROR: snprintf(): %s", "failure");
+        return -1;
+    }
+
+    return 0;
+}
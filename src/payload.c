@@ -30,18 +30,55 @@
 #include "logging.h"
 #include "globvar.h"
 #include "config_parser.h"
+#include "csum.h"
+#include "prng.h"
 
 #define BUFFLEN 6000
+/* 每个动态字段及其后的模板各占一段，另加开头的一段模板 */
+#define SLOT_MAX ((FH_PAYLOAD_PIECE_MAX - 1) / 2)
 #define SET_BE16(a, u16)         \
     do {                         \
         (a)[0] = (u16) >> (8);   \
         (a)[1] = (u16) & (0xff); \
     } while (0)
 
-struct payload_node {
-    uint8_t payload[BUFFLEN];
-    size_t payload_len;
-    struct payload_node *next;
+/*
+ * 所有 payload 首尾相接地存放在同一块连续内存 (arena) 中，
+ * entries 只记录每个 payload 的偏移和长度，选择 payload 时只需访问索引数组。
+ */
+struct payload_entry {
+    size_t off;
+    size_t len;
+    /* payload 的校验和部分和，构造伪造包时不必再遍历 payload */
+    uint32_t sum;
+    /*
+     * -C：只保存解析后的配置，发送时才渲染。
+     * arena 中预先渲染了 index 0，作为渲染失败时的后备。
+     */
+    struct http_config *config;
+    size_t config_count;
+    /* slots[slot_idx, slot_idx + slot_cnt) 为该 payload 的动态字段 */
+    size_t slot_idx;
+    size_t slot_cnt;
+};
+
+/*
+ * 动态字段：payload 在初始化时编译为模板，随机部分只记录位置、长度和类型，
+ * 每次发送时重新填充，因此每个伪造包都不相同。字段均为定长，
+ * Content-Length 等无需修改。
+ */
+enum slot_type {
+    SLOT_DIGIT = 0, /* 0-9 */
+    SLOT_DEC,       /* 十进制数，首位非 0 */
+    SLOT_HEX,       /* 小写十六进制 */
+    SLOT_BODY,      /* Base64 风格的“密文” */
+    SLOT_BYTE       /* 任意字节 */
+};
+
+struct payload_slot {
+    uint16_t off;
+    uint16_t len;
+    uint8_t type;
 };
 
 static const char *http_fmt =
@@ -106,7 +143,28 @@ static const struct tls_client_hello {
         },
 };
 
-static struct payload_node *current_node;
+static uint8_t *arena;
+static size_t arena_len;
+static size_t arena_cap;
+
+static struct payload_entry *entries;
+static size_t entry_cnt;
+static size_t entry_cap;
+
+static struct payload_slot *slots;
+static size_t slot_cnt;
+static size_t slot_cap;
+static size_t slot_mark;
+/* 正在编译的 payload 的起始地址，仅在初始化阶段有效 */
+static const uint8_t *slot_base;
+
+static size_t cursor;
+
+/*
+ * 每个队列线程私有的渲染缓冲区（-C 及动态字段的内容），
+ * 足以容纳 body 最大为 MAX_BODY_SIZE 的 -C payload。
+ */
+static __thread uint8_t scratch[MAX_BODY_SIZE + BUFFLEN];
 
 struct browser_profile {
     const char *name;
@@ -240,121 +298,252 @@ static int rand_range(int min, int max)
     if (max <= min) {
         return min;
     }
-    return min + rand() % (max - min + 1);
+    return min + (int) th_prng_below((uint32_t) (max - min) + 1);
 }
 
-static void rand_hex(char *dst, size_t hex_len)
+static void fill_slot(uint8_t *dst, size_t len, int type)
 {
     static const char hex[] = "0123456789abcdef";
+    static const char charset[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
     size_t i;
-    if (!dst || hex_len == 0) {
-        return;
+    uint8_t b;
+    uint64_t r;
+
+    r = 0;
+    for (i = 0; i < len; i++) {
+        if (i % 8 == 0) {
+            r = th_prng_u64();
+        }
+        b = r & 0xff;
+        r >>= 8;
+
+        switch (type) {
+            case SLOT_DIGIT:
+                dst[i] = '0' + b % 10;
+                break;
+            case SLOT_DEC:
+                dst[i] = i ? '0' + b % 10 : '1' + b % 9;
+                break;
+            case SLOT_HEX:
+                dst[i] = hex[b & 0xf];
+                break;
+            case SLOT_BODY:
+                dst[i] = charset[b % (sizeof(charset) - 1)];
+                break;
+            default:
+                dst[i] = b;
+        }
     }
-    for (i = 0; i < hex_len; i++) {
-        dst[i] = hex[rand() % (sizeof(hex) - 1)];
+}
+
+
+/*
+ * 在 pos 处登记一个动态字段并填充初始值。
+ * pos 必须位于 slot_base 所指向的 payload 内，且按偏移递增、互不重叠的
+ * 顺序登记。
+ */
+static int add_slot(uint8_t *pos, size_t len, int type)
+{
+    size_t new_cap;
+    struct payload_slot *new_slots, *prev;
+
+    fill_slot(pos, len, type);
+
+    if (!slot_base) {
+        return 0;
     }
-    dst[hex_len] = '\0';
+
+    if (slot_cnt - slot_mark >= SLOT_MAX) {
+        E("ERROR: too many dynamic fields in payload");
+        return -1;
+    }
+    if (slot_cnt > slot_mark) {
+        prev = &slots[slot_cnt - 1];
+        if ((size_t) (pos - slot_base) < (size_t) prev->off + prev->len) {
+            E("ERROR: dynamic fields of payload are out of order");
+            return -1;
+        }
+    }
+
+    if (slot_cnt == slot_cap) {
+        new_cap = slot_cap ? slot_cap * 2 : 64;
+        new_slots = realloc(slots, new_cap * sizeof(*slots));
+        if (!new_slots) {
+            E("ERROR: realloc(): %s", strerror(errno));
+            return -1;
+        }
+        slots = new_slots;
+        slot_cap = new_cap;
+    }
+
+    slots[slot_cnt].off = pos - slot_base;
+    slots[slot_cnt].len = len;
+    slots[slot_cnt].type = type;
+    slot_cnt++;
+
+    return 0;
 }
 
-static void make_random_carrier_uri(char *dst, size_t dstlen)
+
+static int append_format(char **p, size_t *remain, const char *fmt, ...)
 {
-    int which = rand_range(0, 2);
-    char token[33];
-    char access_token[33];
+    int n;
+    va_list ap;
+
+    va_start(ap, fmt);
+    n = vsnprintf(*p, *remain, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        return -1;
+    }
+    if ((size_t) n >= *remain) {
+        return -1;
+    }
+
+    *p += n;
+    *remain -= n;
+
+    return 0;
+}
 
-    rand_hex(token, 32);
-    rand_hex(access_token, 32);
+static int append_slot(char **p, size_t *remain, int type, size_t len)
+{
+    if (len > *remain) {
+        return -1;
+    }
+
+    if (add_slot((uint8_t *) *p, len, type) < 0) {
+        return -1;
+    }
+    *p += len;
+    *remain -= len;
+
+    return 0;
+}
+
+
+static int make_random_carrier_uri(char **p, size_t *remain)
+{
+    int which = rand_range(0, 2);
 
     if (which == 0) {
         /* /ik4g/v/C40605803.html?appid=...&token=...&devid=...&version=...&channelid=...
          */
-        unsigned int c_id = (unsigned int) rand_range(10000000, 99999999);
-        unsigned int appid_hi = (unsigned int) rand_range(100000, 999999);
-        unsigned int appid_lo = (unsigned int) rand_range(100000, 999999);
-        unsigned int devid = (unsigned int) rand_range(0, 999999);
-        unsigned int channelid = (unsigned int) rand_range(10000000, 99999999);
         int v1 = rand_range(1, 9);
         int v2 = rand_range(0, 9);
         int v3 = rand_range(0, 99);
         int v4 = rand_range(0, 99);
         int ctch = rand_range(1, 9);
-        snprintf(
-            dst, dstlen,
-            "/ik4g/v/C%08u.html?appid=%06u%06u&token=%s&devid=%06u&version="
-            "%d.%d.%d.%dctch%d&channelid=%08u",
-            c_id, appid_hi, appid_lo, token, devid, v1, v2, v3, v4, ctch,
-            channelid);
+
+        if (append_format(p, remain, "/ik4g/v/C") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 8) < 0 ||
+            append_format(p, remain, ".html?appid=") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 6) < 0 ||
+            append_slot(p, remain, SLOT_DEC, 6) < 0 ||
+            append_format(p, remain, "&token=") < 0 ||
+            append_slot(p, remain, SLOT_HEX, 32) < 0 ||
+            append_format(p, remain, "&devid=") < 0 ||
+            append_slot(p, remain, SLOT_DIGIT, 6) < 0 ||
+            append_format(p, remain, "&version=%d.%d.%d.%dctch%d&channelid=",
+                          v1, v2, v3, v4, ctch) < 0 ||
+            append_slot(p, remain, SLOT_DEC, 8) < 0) {
+            return -1;
+        }
     } else if (which == 1) {
         /* /res/V/1388/mp3/33/58/94/1388335894003000.mp3?mb=...&fs=...&... */
-        unsigned int vdir = (unsigned int) rand_range(1000, 9999);
-        unsigned int a = (unsigned int) rand_range(10, 99);
-        unsigned int b = (unsigned int) rand_range(10, 99);
-        unsigned int c = (unsigned int) rand_range(10, 99);
-        unsigned int file_prefix = (unsigned int) rand_range(1000, 9999);
-        unsigned int f1 = (unsigned int) rand_range(10, 99);
-        unsigned int f2 = (unsigned int) rand_range(10, 99);
-        unsigned int f3 = (unsigned int) rand_range(10, 99);
-        unsigned int f4 = (unsigned int) rand_range(1000, 9999);
         unsigned int fs = (unsigned int) rand_range(1000000, 99999999);
         unsigned int s = (unsigned int) rand_range(100, 900);
-        unsigned int id = (unsigned int) rand_range(10000000, 99999999);
-        unsigned int sid = (unsigned int) rand_range(100000000, 999999999);
-        /* 构造 11 位手机号样式：1 + 10位数字（用两段 5 位拼接，避免溢出） */
-        unsigned int mb_a = (unsigned int) rand_range(0, 99999);
-        unsigned int mb_b = (unsigned int) rand_range(0, 99999);
-
-        snprintf(dst, dstlen,
-                 "/res/V/%04u/mp3/%02u/%02u/%02u/%04u%02u%02u%02u%04u.mp3?"
-                 "mb=1%05u%05u&fs=%u&s=%u&n=&id=%u&M=online&sid=%u",
-                 vdir, a, b, c, file_prefix, f1, f2, f3, f4, mb_a, mb_b, fs, s,
-                 id, sid);
+
+        /* mb 为 11 位手机号样式：1 + 10 位数字 */
+        if (append_format(p, remain, "/res/V/") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 4) < 0 ||
+            append_format(p, remain, "/mp3/") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 2) < 0 ||
+            append_format(p, remain, "/") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 2) < 0 ||
+            append_format(p, remain, "/") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 2) < 0 ||
+            append_format(p, remain, "/") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 16) < 0 ||
+            append_format(p, remain, ".mp3?mb=1") < 0 ||
+            append_slot(p, remain, SLOT_DIGIT, 10) < 0 ||
+            append_format(p, remain, "&fs=%u&s=%u&n=&id=", fs, s) < 0 ||
+            append_slot(p, remain, SLOT_DEC, 8) < 0 ||
+            append_format(p, remain, "&M=online&sid=") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 9) < 0) {
+            return -1;
+        }
     } else {
         /* /api/v2/egame/log.json?access_token=...&imsi=...&vc=...&... */
-        unsigned int imsi_tail = (unsigned int) rand_range(100000000,
-                                                           999999999);
         unsigned int vc = (unsigned int) rand_range(10, 300);
-        unsigned int app_key = (unsigned int) rand_range(1000000, 9999999);
-        unsigned int channel_id = (unsigned int) rand_range(10000000,
-                                                            99999999);
-        snprintf(dst, dstlen,
-                 "/api/v2/egame/log.json?access_token=%s&imsi=4600%011u&vc=%u&"
-                 "app_key=%u&channel_id=%u",
-                 access_token, imsi_tail, vc, app_key, channel_id);
+
+        if (append_format(p, remain, "/api/v2/egame/log.json?access_token=") <
+                0 ||
+            append_slot(p, remain, SLOT_HEX, 32) < 0 ||
+            append_format(p, remain, "&imsi=460000") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 9) < 0 ||
+            append_format(p, remain, "&vc=%u&app_key=", vc) < 0 ||
+            append_slot(p, remain, SLOT_DEC, 7) < 0 ||
+            append_format(p, remain, "&channel_id=") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 8) < 0) {
+            return -1;
+        }
     }
+
+    return 0;
 }
 
-static void make_random_post_uri(char *dst, size_t dstlen)
+static int make_random_post_uri(char **p, size_t *remain)
 {
     /* 模拟上传/提交类接口 */
     int which = rand_range(0, 1);
-    unsigned int id = (unsigned int) rand_range(10000000, 99999999);
 
     if (which == 0) {
         /* /api/v1/upload?file_id=...&session=... */
-        snprintf(dst, dstlen, "/api/v1/upload?file_id=%08u&session=%s", id,
-                 (rand_range(0, 1) == 0) ? "sess" : "auth");
+        if (append_format(p, remain, "/api/v1/upload?file_id=") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 8) < 0 ||
+            append_format(p, remain, "&session=%s",
+                          (rand_range(0, 1) == 0) ? "sess" : "auth") < 0) {
+            return -1;
+        }
     } else {
         /* /user/profile/update?uid=...&token=... */
-        snprintf(dst, dstlen, "/user/profile/update?uid=%08u&token=%s", id,
-                 (rand_range(0, 1) == 0) ? "auth" : "token");
+        if (append_format(p, remain, "/user/profile/update?uid=") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 8) < 0 ||
+            append_format(p, remain, "&token=%s",
+                          (rand_range(0, 1) == 0) ? "auth" : "token") < 0) {
+            return -1;
+        }
     }
+
+    return 0;
 }
 
-static void make_random_put_uri(char *dst, size_t dstlen)
+static int make_random_put_uri(char **p, size_t *remain)
 {
     /* 模拟日志/上报接口 */
     int which = rand_range(0, 1);
-    unsigned int id = (unsigned int) rand_range(10000000, 99999999);
-    unsigned int r = (unsigned int) rand();
+    unsigned int r = (unsigned int) th_prng_below(RAND_MAX);
 
     if (which == 0) {
         /* /log/collect?device_id=...&ts=... */
-        snprintf(dst, dstlen, "/log/collect?device_id=%08u&ts=%u", id, r);
+        if (append_format(p, remain, "/log/collect?device_id=") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 8) < 0 ||
+            append_format(p, remain, "&ts=%u", r) < 0) {
+            return -1;
+        }
     } else {
         /* /api/v2/report?event_id=...&trace_id=... */
-        snprintf(dst, dstlen, "/api/v2/report?event_id=%08u&trace_id=%u", id,
-                 r);
+        if (append_format(p, remain, "/api/v2/report?event_id=") < 0 ||
+            append_slot(p, remain, SLOT_DEC, 8) < 0 ||
+            append_format(p, remain, "&trace_id=%u", r) < 0) {
+            return -1;
+        }
     }
+
+    return 0;
 }
 
 static void make_speedtest_host(char *host, size_t hostlen)
@@ -402,62 +591,11 @@ static void host_without_port(char *dst, size_t dstlen, const char *host)
     dst[i] = '\0';
 }
 
-static int append_format(char **p, size_t *remain, const char *fmt, ...)
-{
-    int n;
-    va_list ap;
-
-    va_start(ap, fmt);
-    n = vsnprintf(*p, *remain, fmt, ap);
-    va_end(ap);
-
-    if (n < 0) {
-        return -1;
-    }
-    if ((size_t) n >= *remain) {
-        return -1;
-    }
-
-    *p += n;
-    *remain -= n;
-
-    return 0;
-}
-
-static int append_raw(char **p, size_t *remain, const uint8_t *data,
-                      size_t len)
-{
-    if (len > *remain) {
-        return -1;
-    }
-
-    memcpy(*p, data, len);
-    *p += len;
-    *remain -= len;
-
-    return 0;
-}
-
-/*
- * 生成随机小数，格式：0.xxxxxxxxxxxxxxxxx (17位小数)
- * 例如：0.6406337111524206
- */
-static void generate_random_decimal(char *buf, size_t buflen)
-{
-    /* 生成 17 位随机数字 */
-    unsigned long long r1, r2, r3;
-    r1 = (unsigned long long) rand() % 1000000; /* 6位 */
-    r2 = (unsigned long long) rand() % 1000000; /* 6位 */
-    r3 = (unsigned long long) rand() % 100000;  /* 5位 */
-    snprintf(buf, buflen, "0.%06llu%06llu%05llu", r1, r2, r3);
-}
-
 static int make_http_simple(uint8_t *buffer, size_t *len)
 {
     const struct browser_profile *bp;
     char *p;
     size_t remain, buffsize;
-    char uri_r[32], referer_r[32];
     int r;
 
     buffsize = *len;
@@ -481,16 +619,15 @@ static int make_http_simple(uint8_t *buffer, size_t *len)
         bp = &browser_profiles[3]; /* Safari / macOS */
     }
 
-    /* 2. 生成两个不同的随机小数（URI 和 Referer 中的 r 参数） */
-    do {
-        generate_random_decimal(uri_r, sizeof(uri_r));
-        generate_random_decimal(referer_r, sizeof(referer_r));
-    } while (strcmp(uri_r, referer_r) == 0); /* 确保不重复 */
-
-    /* 3. 构建 HTTP 请求 */
+    /*
+     * 2. 构建 HTTP 请求
+     * URI 和 Referer 中的 r 参数为 17 位随机小数，如 0.6406337111524206，
+     * 每次发送时重新生成。
+     */
     /* Request Line: POST /backend/empty.php?r=... HTTP/1.1 */
-    if (append_format(&p, &remain, "POST /backend/empty.php?r=%s HTTP/1.1\r\n",
-                      uri_r) < 0) {
+    if (append_format(&p, &remain, "POST /backend/empty.php?r=0.") < 0 ||
+        append_slot(&p, &remain, SLOT_DIGIT, 17) < 0 ||
+        append_format(&p, &remain, " HTTP/1.1\r\n") < 0) {
         return -1;
     }
 
@@ -507,9 +644,10 @@ static int make_http_simple(uint8_t *buffer, size_t *len)
     /* Referer */
     if (append_format(
             &p, &remain,
-            "Referer: "
-            "https://test.ustc.edu.cn/speedtest_worker.js.php?r=%s\r\n",
-            referer_r) < 0) {
+            "Referer: https://test.ustc.edu.cn/speedtest_worker.js.php?r=0.") <
+            0 ||
+        append_slot(&p, &remain, SLOT_DIGIT, 17) < 0 ||
+        append_format(&p, &remain, "\r\n") < 0) {
         return -1;
     }
 
@@ -523,17 +661,6 @@ static int make_http_simple(uint8_t *buffer, size_t *len)
     return 0;
 }
 
-static void generate_cipher_like_body(uint8_t *buf, size_t len)
-{
-    static const char charset[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
-    size_t i;
-
-    for (i = 0; i < len; i++) {
-        buf[i] = (uint8_t) charset[rand() % (sizeof(charset) - 1)];
-    }
-}
-
 static int make_http_zerorate_from_template(
     uint8_t *buffer, size_t *len, const struct zerorate_http_template *tpl)
 {
@@ -542,7 +669,6 @@ static int make_http_zerorate_from_template(
     int use_post;
     const char *method_str;
     size_t body_len = 0;
-    uint8_t body_buf[100];
 
     buffsize = *len;
     if (buffsize < 256) {
@@ -573,12 +699,8 @@ static int make_http_zerorate_from_template(
     }
 
     if (use_post) {
-        /* 生成一个 < 100 字节的“加密风格” body */
+        /* 一个 < 100 字节的“加密风格” body，内容在发送时生成 */
         body_len = (size_t) rand_range(32, 96);
-        if (body_len > sizeof(body_buf)) {
-            body_len = sizeof(body_buf);
-        }
-        generate_cipher_like_body(body_buf, body_len);
 
         /* 把 Content-Type/Content-Length 补齐到 header 里 */
         if (append_format(&p, &remain,
@@ -599,7 +721,7 @@ static int make_http_zerorate_from_template(
 
     /* 写入 body（仅 POST） */
     if (use_post && body_len > 0) {
-        if (append_raw(&p, &remain, body_buf, body_len) < 0) {
+        if (append_slot(&p, &remain, SLOT_BODY, body_len) < 0) {
             return -1;
         }
     }
@@ -621,8 +743,6 @@ static int make_http_random(uint8_t *buffer, size_t *len, char *hostname)
     char origin_url[256];
     char referer_url[256];
     const char *method_str;
-    const char *path;
-    char pathbuf[512];
     int method; /* 0: GET, 1: POST, 2: PUT, 3: OPTIONS */
     int is_top_level;
     int is_cross_origin;
@@ -630,7 +750,6 @@ static int make_http_random(uint8_t *buffer, size_t *len, char *hostname)
     int has_referer;
     int target_method_for_cors;
     size_t body_len = 0;
-    uint8_t body_buf[100];
     int r;
 
     buffsize = *len;
@@ -673,24 +792,16 @@ static int make_http_random(uint8_t *buffer, size_t *len, char *hostname)
     switch (method) {
         case 0:
             method_str = "GET";
-            make_random_carrier_uri(pathbuf, sizeof(pathbuf));
-            path = pathbuf;
             break;
         case 1:
             method_str = "POST";
-            make_random_post_uri(pathbuf, sizeof(pathbuf));
-            path = pathbuf;
             break;
         case 2:
             method_str = "PUT";
-            make_random_put_uri(pathbuf, sizeof(pathbuf));
-            path = pathbuf;
             break;
         case 3:
         default:
             method_str = "OPTIONS";
-            make_random_carrier_uri(pathbuf, sizeof(pathbuf));
-            path = pathbuf;
             break;
     }
 
@@ -713,8 +824,26 @@ static int make_http_random(uint8_t *buffer, size_t *len, char *hostname)
     }
 
     /* 5. HEAD LINE: METHOD PATH HTTP/1.1 */
-    if (append_format(&p, &remain, "%s %s HTTP/1.1\r\n", method_str, path) <
-        0) {
+    if (append_format(&p, &remain, "%s ", method_str) < 0) {
+        return -1;
+    }
+
+    switch (method) {
+        case 1:
+            r = make_random_post_uri(&p, &remain);
+            break;
+        case 2:
+            r = make_random_put_uri(&p, &remain);
+            break;
+        default:
+            r = make_random_carrier_uri(&p, &remain);
+            break;
+    }
+    if (r < 0) {
+        return -1;
+    }
+
+    if (append_format(&p, &remain, " HTTP/1.1\r\n") < 0) {
         return -1;
     }
 
@@ -775,13 +904,8 @@ static int make_http_random(uint8_t *buffer, size_t *len, char *hostname)
     /* 7. Content-Type / Content-Length / CORS / sec-fetch-* */
     if (method == 1 || method == 2) {
         /* POST / PUT: 必须有 body 和 Content-Length */
+        /* “加密风格”内容：Base64/随机密文样式，在发送时生成 */
         body_len = (size_t) rand_range(24, 96); /* < 100 bytes */
-        if (body_len >= sizeof(body_buf)) {
-            body_len = sizeof(body_buf) - 1;
-        }
-
-        /* “加密风格”内容：Base64/随机密文样式 */
-        generate_cipher_like_body(body_buf, body_len);
 
         if (append_format(&p, &remain,
                           "Content-Type: application/octet-stream\r\n") < 0) {
@@ -841,7 +965,7 @@ static int make_http_random(uint8_t *buffer, size_t *len, char *hostname)
 
     /* 写入 body（仅 POST / PUT） */
     if ((method == 1 || method == 2) && body_len > 0) {
-        if (append_raw(&p, &remain, body_buf, body_len) < 0) {
+        if (append_slot(&p, &remain, SLOT_BODY, body_len) < 0) {
             return -1;
         }
     }
@@ -852,65 +976,79 @@ static int make_http_random(uint8_t *buffer, size_t *len, char *hostname)
 }
 
 /*
- * 将当前的 payload 环形链表打乱成随机顺序。
+ * 将索引数组打乱成随机顺序，arena 中的数据不动。
  * 仅在初始化阶段调用一次即可。
  */
-static void shuffle_payload_ring(void)
+static void shuffle_payload_entries(void)
 {
-    struct payload_node *node;
-    struct payload_node **nodes;
-    size_t count, i;
-
-    if (!current_node) {
-        return;
-    }
+    size_t i, j;
+    struct payload_entry tmp;
 
-    /* 0 或 1 个节点，无需打乱 */
-    if (current_node->next == current_node) {
-        return;
+    for (i = entry_cnt; i > 1; i--) {
+        j = (size_t) rand_range(0, (int) i - 1);
+        tmp = entries[i - 1];
+        entries[i - 1] = entries[j];
+        entries[j] = tmp;
     }
+}
 
-    /* 1. 统计节点数量 */
-    count = 0;
-    node = current_node;
-    do {
-        count++;
-        node = node->next;
-    } while (node != current_node);
 
-    /* 2. 拷贝到数组中 */
-    nodes = malloc(count * sizeof(*nodes));
-    if (!nodes) {
-        E("ERROR: malloc(): %s", strerror(errno));
-        return;
+/*
+ * 将 buffer 追加到 arena 末尾，并为其新增一个索引项。
+ */
+static struct payload_entry *add_payload(const uint8_t *buffer, size_t len)
+{
+    size_t new_cap;
+    uint8_t *new_arena;
+    struct payload_entry *entry, *new_entries;
+
+    if (arena_len + len > arena_cap) {
+        new_cap = arena_cap ? arena_cap : BUFFLEN;
+        while (arena_len + len > new_cap) {
+            new_cap *= 2;
+        }
+        new_arena = realloc(arena, new_cap);
+        if (!new_arena) {
+            E("ERROR: realloc(): %s", strerror(errno));
+            return NULL;
+        }
+        arena = new_arena;
+        arena_cap = new_cap;
     }
 
-    node = current_node;
-    for (i = 0; i < count; i++) {
-        nodes[i] = node;
-        node = node->next;
+    if (entry_cnt == entry_cap) {
+        new_cap = entry_cap ? entry_cap * 2 : 16;
+        new_entries = realloc(entries, new_cap * sizeof(*entries));
+        if (!new_entries) {
+            E("ERROR: realloc(): %s", strerror(errno));
+            return NULL;
+        }
+        entries = new_entries;
+        entry_cap = new_cap;
     }
 
-    /* 3. Fisher–Yates 洗牌 */
-    for (i = count - 1; i > 0; i--) {
-        size_t j = (size_t) rand_range(0, (int) i);
-        struct payload_node *tmp = nodes[i];
-        nodes[i] = nodes[j];
-        nodes[j] = tmp;
+    /* -C 的索引项不在 arena 中保存数据，此时 arena 可能尚未分配 */
+    if (len > 0) {
+        memcpy(arena + arena_len, buffer, len);
     }
 
-    /* 4. 根据打乱后的顺序重新链接成环 */
-    for (i = 0; i + 1 < count; i++) {
-        nodes[i]->next = nodes[i + 1];
-    }
-    nodes[count - 1]->next = nodes[0];
+    entry = &entries[entry_cnt++];
+    memset(entry, 0, sizeof(*entry));
+    entry->off = arena_len;
+    entry->len = len;
+    entry->sum = fh_csum_partial(buffer, len, 0);
+
+    /* 自上一个 payload 之后登记的动态字段都属于它 */
+    entry->slot_idx = slot_mark;
+    entry->slot_cnt = slot_cnt - slot_mark;
+    slot_mark = slot_cnt;
 
-    /* 从新的首节点开始轮询 */
-    current_node = nodes[0];
+    arena_len += len;
 
-    free(nodes);
+    return entry;
 }
 
+
 static int make_http_get(uint8_t *buffer, size_t *len, char *hostname)
 {
     int len_, buffsize;
@@ -935,7 +1073,7 @@ static int make_http_get(uint8_t *buffer, size_t *len, char *hostname)
 static int make_tls_client_hello(uint8_t *buffer, size_t *len, char *hostname)
 {
     int padding_len;
-    size_t i, buffsize;
+    size_t buffsize;
     struct tls_client_hello *tls_data;
     struct tls_ext_server_name_head *server_name_head;
     struct tls_ext_padding_head *padding_head;
@@ -950,12 +1088,11 @@ static int make_tls_client_hello(uint8_t *buffer, size_t *len, char *hostname)
     tls_data = (struct tls_client_hello *) buffer;
     memcpy(tls_data, &cli_hello_tmpl, sizeof(cli_hello_tmpl));
 
-    for (i = 0; i < sizeof(tls_data->random); i++) {
-        tls_data->random[i] = rand();
-    }
-
-    for (i = 0; i < sizeof(tls_data->session_id); i++) {
-        tls_data->session_id[i] = rand();
+    /* random 与 session_id 在每次发送时重新生成 */
+    if (add_slot(tls_data->random, sizeof(tls_data->random), SLOT_BYTE) < 0 ||
+        add_slot(tls_data->session_id, sizeof(tls_data->session_id),
+                 SLOT_BYTE) < 0) {
+        return -1;
     }
 
     size_t hostname_len = strlen(hostname);
@@ -1036,242 +1173,166 @@ static int make_custom(uint8_t *buffer, size_t *len, char *filepath)
 int fh_payload_setup(void)
 {
     int res;
-    size_t len;
+    size_t len, i;
     struct payload_info *pinfo;
-    struct payload_node *node, *next;
+    struct payload_entry *entry;
+    struct http_config *config;
+    uint8_t buff[BUFFLEN];
 
-    for (pinfo = g_ctx.plinfo; pinfo->type; pinfo++) {
-        node = malloc(sizeof(*node));
-        if (!node) {
-            E("ERROR: malloc(): %s", strerror(errno));
-            goto cleanup;
-        }
+    /* 各 make_* 函数均在 buff 中生成 payload，动态字段的偏移以此为基准 */
+    slot_base = buff;
 
-        if (current_node) {
-            next = current_node->next;
-            current_node->next = node;
-            node->next = next;
-        } else {
-            current_node = node;
-            node->next = node;
-        }
+    for (pinfo = g_ctx.plinfo; pinfo->type; pinfo++) {
+        slot_mark = slot_cnt;
 
         switch (pinfo->type) {
             case FH_PAYLOAD_CUSTOM:
-                len = sizeof(node->payload);
-                res = make_custom(node->payload, &len, pinfo->info);
+                len = sizeof(buff);
+                res = make_custom(buff, &len, pinfo->info);
                 if (res < 0) {
                     E(T(make_custom));
                     goto cleanup;
                 }
-                node->payload_len = len;
+                if (!add_payload(buff, len)) {
+                    E(T(add_payload));
+                    goto cleanup;
+                }
                 break;
 
             case FH_PAYLOAD_HTTP:
-                len = sizeof(node->payload);
-                res = make_http_get(node->payload, &len, pinfo->info);
+                len = sizeof(buff);
+                res = make_http_get(buff, &len, pinfo->info);
                 if (res < 0) {
                     E(T(make_http_get));
                     goto cleanup;
                 }
-                node->payload_len = len;
+                if (!add_payload(buff, len)) {
+                    E(T(add_payload));
+                    goto cleanup;
+                }
                 break;
 
             case FH_PAYLOAD_HTTPS:
-                len = sizeof(node->payload);
-                res = make_tls_client_hello(node->payload, &len, pinfo->info);
+                len = sizeof(buff);
+                res = make_tls_client_hello(buff, &len, pinfo->info);
                 if (res < 0) {
                     E(T(make_tls_client_hello));
                     goto cleanup;
                 }
-                node->payload_len = len;
+                if (!add_payload(buff, len)) {
+                    E(T(add_payload));
+                    goto cleanup;
+                }
                 break;
 
-            case FH_PAYLOAD_HTTP_CONFIG: {
+            case FH_PAYLOAD_HTTP_CONFIG:
                 /*
-                 * 新的 -C 功能：从配置文件生成多个 payload
-                 * 根据配置文件中的 methods, uris, headers 的组合生成所有可能的
-                 * payload
+                 * -C 功能：根据配置文件中 methods, uris, headers 的组合生成
+                 * payload。组合数量可能非常大，因此不再预先生成全部 payload，
+                 * 而是只保留解析后的配置，发送时按随机 index 渲染，
+                 * 内存占用与组合数量无关。
                  */
-                struct http_config config;
-                size_t payload_count, i;
-                struct payload_node *use_node;
-                const size_t MAX_PAYLOAD_COUNT =
-                    100000; /* 最多 10 万个，防止 OOM */
+                config = malloc(sizeof(*config));
+                if (!config) {
+                    E("ERROR: malloc(): %s", strerror(errno));
+                    goto cleanup;
+                }
 
                 /* 解析配置文件 */
-                res = fh_config_parse(pinfo->info, &config);
+                res = fh_config_parse(pinfo->info, config);
                 if (res < 0) {
                     E("ERROR: Failed to parse config file: %s", pinfo->info);
+                    free(config);
                     goto cleanup;
                 }
 
-                /* 计算需要生成的 payload 数量 */
-                payload_count = fh_config_get_payload_count(&config);
-                if (payload_count == 0) {
-                    E("ERROR: No payloads can be generated from config");
-                    fh_config_free(&config);
+                /* 确保任意组合都能渲染到线程私有缓冲区中 */
+                len = fh_config_get_max_payload_len(config);
+                if (len > sizeof(scratch)) {
+                    E("ERROR: payloads from config file %s may need %zu "
+                      "bytes, more than the limit of %zu",
+                      pinfo->info, len, sizeof(scratch));
+                    fh_config_free(config);
+                    free(config);
                     goto cleanup;
                 }
 
-                /* 检查 payload 数量是否超出限制 */
-                if (payload_count > MAX_PAYLOAD_COUNT) {
-                    E("ERROR: Too many payloads (%zu) would be generated from "
-                      "config",
-                      payload_count);
-                    E("ERROR: Maximum allowed is %zu payloads (approx %.1f MB "
-                      "memory)",
-                      MAX_PAYLOAD_COUNT, (MAX_PAYLOAD_COUNT * 6.0) / 1024.0);
-                    E("ERROR: Please reduce the number of methods/URIs/header "
-                      "values in your config");
-                    fh_config_free(&config);
+                /* 发送时总是重新渲染，arena 中不保存模板 */
+                entry = add_payload(buff, 0);
+                if (!entry) {
+                    E(T(add_payload));
+                    fh_config_free(config);
+                    free(config);
                     goto cleanup;
                 }
-
-                E("Generating %zu payloads from config file (approx %.1f MB "
-                  "memory)",
-                  payload_count, (payload_count * 6.0) / 1024.0);
-
-                /* 生成所有 payload */
-                for (i = 0; i < payload_count; i++) {
-                    if (i == 0) {
-                        /* 第一个 payload 复用当前分配的 node */
-                        use_node = node;
-                    } else {
-                        /* 其余 payload 各自分配一个 node */
-                        use_node = malloc(sizeof(*use_node));
-                        if (!use_node) {
-                            E("ERROR: malloc(): %s", strerror(errno));
-                            fh_config_free(&config);
-                            goto cleanup;
-                        }
-
-                        if (current_node) {
-                            next = current_node->next;
-                            current_node->next = use_node;
-                            use_node->next = next;
-                        } else {
-                            current_node = use_node;
-                            use_node->next = use_node;
-                        }
-                    }
-
-                    len = sizeof(use_node->payload);
-                    res = fh_config_generate_payload(
-                        &config, use_node->payload, &len, i);
-                    if (res < 0) {
-                        E("ERROR: Failed to generate payload %zu", i);
-                        fh_config_free(&config);
-                        goto cleanup;
-                    }
-                    use_node->payload_len = len;
-                    current_node = use_node;
+                entry->config = config;
+                entry->config_count = fh_config_get_payload_count(config);
+                if (entry->config_count == 0) {
+                    E("ERROR: No payloads can be generated from config");
+                    goto cleanup;
                 }
 
-                fh_config_free(&config);
+                E("%zu payload combinations from config file, rendered on "
+                  "demand",
+                  entry->config_count);
                 break;
-            }
 
-            case FH_PAYLOAD_HTTP_RANDOM: {
+            case FH_PAYLOAD_HTTP_RANDOM:
                 /*
                  * 对于每个 -c 传入的 hostname，预先生成多份随机 HTTP 报文，
-                 * 并全部挂到环形链表中，后续循环复用。
+                 * 全部追加到 arena 中，后续循环复用。
                  *
                  * 目前实现为：每个 hostname 生成 100 份随机报文。
                  */
-                size_t i;
-                struct payload_node *use_node;
-
                 for (i = 0; i < 100; i++) {
-                    if (i == 0) {
-                        /* 第一个报文复用当前分配的 node */
-                        use_node = node;
-                    } else {
-                        /* 其余报文各自分配一个 node，并插入到环形链表中 */
-                        use_node = malloc(sizeof(*use_node));
-                        if (!use_node) {
-                            E("ERROR: malloc(): %s", strerror(errno));
-                            goto cleanup;
-                        }
-
-                        if (current_node) {
-                            next = current_node->next;
-                            current_node->next = use_node;
-                            use_node->next = next;
-                        } else {
-                            current_node = use_node;
-                            use_node->next = use_node;
-                        }
-                    }
-
-                    len = sizeof(use_node->payload);
+                    len = sizeof(buff);
                     /*
                      *   pinfo->info 为单次 -c 传入的 hostname；
                      *   如果需要基于所有 -c 的 hostname 进行组合/随机，
                      *   可以在 make_http_random 内部遍历 g_ctx.plinfo。
                      */
-                    res = make_http_random(use_node->payload, &len,
-                                           pinfo->info);
+                    res = make_http_random(buff, &len, pinfo->info);
                     if (res < 0) {
                         E(T(make_http_random));
                         goto cleanup;
                     }
-                    use_node->payload_len = len;
-                    current_node = use_node;
+                    if (!add_payload(buff, len)) {
+                        E(T(add_payload));
+                        goto cleanup;
+                    }
                 }
                 break;
-            }
 
             case FH_PAYLOAD_HTTP_SIMPLE:
-                len = sizeof(node->payload);
-                res = make_http_simple(node->payload, &len);
+                len = sizeof(buff);
+                res = make_http_simple(buff, &len);
                 if (res < 0) {
                     E(T(make_http_simple));
                     goto cleanup;
                 }
-                node->payload_len = len;
+                if (!add_payload(buff, len)) {
+                    E(T(add_payload));
+                    goto cleanup;
+                }
                 break;
 
-            case FH_PAYLOAD_HTTP_ZERORATE: {
-                size_t tcount = sizeof(zerorate_templates) /
-                                sizeof(zerorate_templates[0]);
-                size_t ti;
-                struct payload_node *use_node;
-
-                for (ti = 0; ti < tcount; ti++) {
-                    if (ti == 0) {
-                        /* 第一个模板复用当前分配的 node */
-                        use_node = node;
-                    } else {
-                        /* 其余模板各自分配一个 node，并插入到环形链表中 */
-                        use_node = malloc(sizeof(*use_node));
-                        if (!use_node) {
-                            E("ERROR: malloc(): %s", strerror(errno));
-                            goto cleanup;
-                        }
-
-                        if (current_node) {
-                            next = current_node->next;
-                            current_node->next = use_node;
-                            use_node->next = next;
-                        } else {
-                            current_node = use_node;
-                            use_node->next = use_node;
-                        }
-                    }
-
-                    len = sizeof(use_node->payload);
+            case FH_PAYLOAD_HTTP_ZERORATE:
+                for (i = 0; i < sizeof(zerorate_templates) /
+                                    sizeof(zerorate_templates[0]);
+                     i++) {
+                    len = sizeof(buff);
                     res = make_http_zerorate_from_template(
-                        use_node->payload, &len, &zerorate_templates[ti]);
+                        buff, &len, &zerorate_templates[i]);
                     if (res < 0) {
                         E(T(make_http_zerorate_from_template));
                         goto cleanup;
                     }
-                    use_node->payload_len = len;
-                    current_node = use_node;
+                    if (!add_payload(buff, len)) {
+                        E(T(add_payload));
+                        goto cleanup;
+                    }
                 }
                 break;
-            }
 
             default:
                 E("ERROR: Unknown payload type");
@@ -1279,17 +1340,23 @@ int fh_payload_setup(void)
         }
     }
 
-    if (!current_node) {
+    if (!entry_cnt) {
         E("ERROR: No payload is available");
         goto cleanup;
     }
 
-    /* payload 全部生成完成后，将环形链表整体打乱成随机顺序 */
-    shuffle_payload_ring();
+    /* payload 全部生成完成后，将索引整体打乱成随机顺序 */
+    shuffle_payload_entries();
+    cursor = 0;
+    slot_base = NULL;
+
+    E("%zu payloads, %zu dynamic fields rendered on send", entry_cnt,
+      slot_cnt);
 
     return 0;
 
 cleanup:
+    slot_base = NULL;
     fh_payload_cleanup();
 
     return -1;
@@ -1298,23 +1365,108 @@ cleanup:
 
 void fh_payload_cleanup(void)
 {
-    struct payload_node *node, *next_node;
+    size_t i;
 
-    node = current_node;
-    while (node) {
-        next_node = node->next;
-        free(node);
-        if (next_node == current_node) {
-            break;
+    for (i = 0; i < entry_cnt; i++) {
+        if (entries[i].config) {
+            fh_config_free(entries[i].config);
+            free(entries[i].config);
         }
-        node = next_node;
     }
+
+    free(entries);
+    entries = NULL;
+    entry_cnt = 0;
+    entry_cap = 0;
+
+    free(arena);
+    arena = NULL;
+    arena_len = 0;
+    arena_cap = 0;
+
+    free(slots);
+    slots = NULL;
+    slot_cnt = 0;
+    slot_cap = 0;
+    slot_mark = 0;
 }
 
 
-void th_payload_get(uint8_t **payload_ptr, size_t *payload_len)
+int th_payload_get(struct fh_payload *payload)
 {
-    *payload_ptr = current_node->payload;
-    *payload_len = current_node->payload_len;
-    current_node = current_node->next;
+    int res;
+    size_t index, len, i, pos, off;
+    uint32_t sum, old_sum, new_sum;
+    uint8_t *tmpl, *dst;
+    struct payload_entry *entry;
+    struct payload_slot *slot;
+    struct iovec *piece;
+
+    /* 轮询索引数组，多个队列线程之间无需加锁 */
+    entry = &entries[__atomic_fetch_add(&cursor, 1, __ATOMIC_RELAXED) %
+                     entry_cnt];
+
+    if (entry->config) {
+        index = th_prng_u64() % entry->config_count;
+
+        /* 渲染到线程私有缓冲区 */
+        len = sizeof(scratch);
+        res = fh_config_generate_payload(entry->config, scratch, &len, index);
+        if (res < 0) {
+            E(T(fh_config_generate_payload));
+            return -1;
+        }
+        payload->piece[0].iov_base = scratch;
+        payload->piece[0].iov_len = len;
+        payload->piece_cnt = 1;
+        payload->len = len;
+        payload->sum = fh_csum_partial(scratch, len, 0);
+        return 0;
+    }
+
+    /*
+     * 模板留在 arena 中不做复制，只把动态字段重新渲染到线程私有缓冲区，
+     * 发送时与模板的其余部分拼接成多段。
+     * 校验和按 RFC 1624 增量更新：只重新计算字段本身，开销与 payload
+     * 长度无关。
+     */
+    tmpl = arena + entry->off;
+    sum = entry->sum;
+    piece = payload->piece;
+    dst = scratch;
+    pos = 0;
+    for (i = 0; i < entry->slot_cnt; i++) {
+        slot = &slots[entry->slot_idx + i];
+        off = slot->off;
+
+        if (off > pos) {
+            piece->iov_base = tmpl + pos;
+            piece->iov_len = off - pos;
+            piece++;
+        }
+
+        fill_slot(dst, slot->len, slot->type);
+        old_sum = fh_csum_add(0, fh_csum_partial(tmpl + off, slot->len, 0),
+                              off);
+        new_sum = fh_csum_add(0, fh_csum_partial(dst, slot->len, 0), off);
+        sum = fh_csum_replace(sum, old_sum, new_sum);
+
+        piece->iov_base = dst;
+        piece->iov_len = slot->len;
+        piece++;
+
+        dst += slot->len;
+        pos = off + slot->len;
+    }
+    if (pos < entry->len || piece == payload->piece) {
+        piece->iov_base = tmpl + pos;
+        piece->iov_len = entry->len - pos;
+        piece++;
+    }
+
+    payload->piece_cnt = piece - payload->piece;
+    payload->len = entry->len;
+    payload->sum = sum;
+
+    return 0;
 }
@@ -0,0 +1,140 @@
+/*
+ * prng.c - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "prng.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "globvar.h"
+#include "logging.h"
+
+/*
+    xoshiro256** with one state per thread, so that the packet path never
+    touches the global lock behind rand(). Each queue thread derives its
+    state from the process seed and its queue number, never from the order
+    in which threads start, which keeps runs with --seed reproducible.
+    Threads that do not serve a queue (the main thread while setting up)
+    share one separate stream.
+*/
+struct prng_state {
+    uint64_t s[4];
+    int ready;
+};
+
+/* stream of the threads that never called th_prng_seed() */
+#define STREAM_DEFAULT UINT64_MAX
+
+static uint64_t base_seed = 0;
+static __thread struct prng_state state;
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z;
+
+    z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+
+static uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+/*
+    Seed the calling thread with stream number stream. splitmix64 runs over
+    both the stream number and the process seed, so that neighbouring
+    streams do not yield related states.
+*/
+void th_prng_seed(uint64_t stream)
+{
+    uint64_t x;
+
+    x = stream;
+    x = base_seed ^ splitmix64(&x);
+
+    state.s[0] = splitmix64(&x);
+    state.s[1] = splitmix64(&x);
+    state.s[2] = splitmix64(&x);
+    state.s[3] = splitmix64(&x);
+    state.ready = 1;
+}
+
+
+int fh_prng_setup(void)
+{
+    ssize_t res;
+
+    if (g_ctx.use_seed) {
+        base_seed = g_ctx.seed;
+        E("PRNG seed: %llu", (unsigned long long) base_seed);
+        return 0;
+    }
+
+    res = getrandom(&base_seed, sizeof(base_seed), GRND_NONBLOCK);
+    if (res != (ssize_t) sizeof(base_seed)) {
+        E("WARNING: getrandom(): %s, falling back to time-based seed",
+          res < 0 ? strerror(errno) : "short read");
+        base_seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    }
+
+    return 0;
+}
+
+
+uint64_t th_prng_u64(void)
+{
+    uint64_t result, t;
+
+    if (!state.ready) {
+        th_prng_seed(STREAM_DEFAULT);
+    }
+
+    result = rotl(state.s[1] * 5, 7) * 9;
+    t = state.s[1] << 17;
+
+    state.s[2] ^= state.s[0];
+    state.s[3] ^= state.s[1];
+    state.s[1] ^= state.s[2];
+    state.s[0] ^= state.s[3];
+    state.s[2] ^= t;
+    state.s[3] = rotl(state.s[3], 45);
+
+    return result;
+}
+
+
+/*
+    Uniform in [0, bound), using the high bits of a 32x32 multiply
+    (Lemire). The bias is below 2^-32 for the small bounds used here.
+*/
+uint32_t th_prng_below(uint32_t bound)
+{
+    return (uint32_t) (((th_prng_u64() >> 32) * (uint64_t) bound) >> 32);
+}
@@ -24,26 +24,41 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <netinet/tcp.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/if_packet.h>
 #include <linux/netfilter.h>
-#include <libnetfilter_queue/libnetfilter_queue_tcp.h>
 
+#include "csum.h"
 #include "globvar.h"
 #include "ipv4pkt.h"
 #include "ipv6pkt.h"
 #include "logging.h"
 #include "payload.h"
-#include "srcinfo.h"
+#include "sockpool.h"
+#include "txring.h"
+#include "xsk.h"
 #include "conntrack.h"
 
-static uint8_t *payload = NULL;
-static size_t payload_len = 0;
+/* maximum number of segments per fake payload */
+#define SEG_MAX 64
+/* never split a payload into segments smaller than this */
+#define MSS_MIN 64
+/* messages per sendmmsg() call */
+#define SEND_BATCH 64
+
+struct pkt_vec {
+    struct iovec *iov;
+    int iovcnt;
+};
+
 static int sockfd = -1;
 
 static int hop_estimate(uint8_t ttl)
@@ -76,43 +91,17 @@ static uint8_t calc_snd_ttl(int hops)
 }
 
 
-static void ipaddr_to_str(struct sockaddr *addr, char ipstr[INET6_ADDRSTRLEN])
-{
-    static const char invalid[] = "INVALID";
-
-    const char *res;
-
-    if (addr->sa_family == AF_INET) {
-        res = inet_ntop(AF_INET, &((struct sockaddr_in *) addr)->sin_addr,
-                        ipstr, INET_ADDRSTRLEN);
-        if (!res) {
-            goto invalid;
-        }
-        return;
-    } else if (addr->sa_family == AF_INET6) {
-        res = inet_ntop(AF_INET6, &((struct sockaddr_in6 *) addr)->sin6_addr,
-                        ipstr, INET6_ADDRSTRLEN);
-        if (!res) {
-            goto invalid;
-        }
-        return;
-    }
-
-invalid:
-    memcpy(ipstr, invalid, sizeof(invalid));
-}
-
-
-static int remove_tfo_cookie(uint16_t ethertype, uint8_t *pkt,
-                             struct tcphdr *tcph)
+static int remove_tfo_cookie(struct tcphdr *tcph)
 {
     int not_found = 0;
     size_t i = 0, tcpopt_len;
     uint8_t *tcpopt_data, kind, len;
+    uint32_t old_sum;
 
     not_found = 1;
     tcpopt_len = tcph->doff * 4 - sizeof(*tcph);
     tcpopt_data = (uint8_t *) tcph + sizeof(*tcph);
+    old_sum = fh_csum_partial(tcpopt_data, tcpopt_len, 0);
 
     while (i < tcpopt_len) {
         kind = tcpopt_data[i];
@@ -139,11 +128,13 @@ static int remove_tfo_cookie(uint16_t ethertype, uint8_t *pkt,
     }
 
     if (!not_found) {
-        if (ethertype == ETHERTYPE_IP) {
-            nfq_tcp_compute_checksum_ipv4(tcph, (struct iphdr *) pkt);
-        } else if (ethertype == ETHERTYPE_IPV6) {
-            nfq_tcp_compute_checksum_ipv6(tcph, (struct ip6_hdr *) pkt);
-        }
+        /*
+            Only the options changed, so patch the checksum incrementally
+            instead of summing the whole segment again.
+        */
+        tcph->check = fh_csum_fold(
+            fh_csum_replace(~tcph->check & 0xffff, old_sum,
+                            fh_csum_partial(tcpopt_data, tcpopt_len, 0)));
     }
 
     return not_found;
@@ -151,110 +142,417 @@ static int remove_tfo_cookie(uint16_t ethertype, uint8_t *pkt,
 
 
 /*
-    This is a workaround for iptables since it does not allow us to intercept
-    packets after POSTROUTING SNAT, which means the SNATed source address is
-    unknown.
-    Instead of using an AF_PACKET socket, we create a temporary AF_INET or
-    AF_INET6 raw socket, so that the packet gets SNATed correctly.
+    Look up the MTU of an interface. The last answer is cached per thread
+    for a few seconds, since fake packets mostly leave through the same
+    interface.
 */
-static int sendto_snat(struct sockaddr_ll *sll, struct sockaddr *daddr,
-                       uint8_t *pkt_buff, int pkt_len)
+static int if_mtu(int ifindex)
 {
-    int res, ret, sock_fd;
-    ssize_t nbytes;
-    char *iface, iface_buf[IF_NAMESIZE];
+    static __thread int cached_ifindex = 0, cached_mtu = 0;
+    static __thread time_t cached_until = 0;
+    int res;
+    time_t now;
+    struct ifreq ifr;
+
+    now = time(NULL);
+    if (ifindex == cached_ifindex && now < cached_until) {
+        return cached_mtu;
+    }
 
-    ret = -1;
+    memset(&ifr, 0, sizeof(ifr));
+    if (!if_indextoname(ifindex, ifr.ifr_name)) {
+        return -1;
+    }
 
-    iface = if_indextoname(sll->sll_ifindex, iface_buf);
-    if (!iface) {
-        E("ERROR: if_indextoname(): %s", strerror(errno));
+    res = ioctl(sockfd, SIOCGIFMTU, &ifr);
+    if (res < 0) {
         return -1;
     }
 
-    sock_fd = socket(daddr->sa_family, SOCK_RAW, IPPROTO_RAW);
+    cached_ifindex = ifindex;
+    cached_mtu = ifr.ifr_mtu;
+    cached_until = now + 5;
+
+    return cached_mtu;
+}
+
+
+/*
+    Value of the MSS option of a SYN or SYN-ACK, 0 if it has none.
+*/
+static uint16_t syn_mss(struct tcphdr *syn)
+{
+    size_t i, tcpopt_len;
+    uint8_t *tcpopt_data, kind, len;
+
+    tcpopt_len = syn->doff * 4 - sizeof(*syn);
+    tcpopt_data = (uint8_t *) syn + sizeof(*syn);
+
+    for (i = 0; i < tcpopt_len;) {
+        kind = tcpopt_data[i];
+        if (kind == 0) {
+            break;
+        } else if (kind == 1) {
+            i++;
+            continue;
+        }
+
+        if (i + 1 >= tcpopt_len) {
+            break;
+        }
+
+        len = tcpopt_data[i + 1];
+        if (len < 2 || i + len > tcpopt_len) {
+            break;
+        }
+
+        if (kind == 2 /* MSS */ && len == 4) {
+            return (tcpopt_data[i + 2] << 8) | tcpopt_data[i + 3];
+        }
+        i += len;
+    }
+
+    return 0;
+}
+
+
+/*
+    MSS for fake segments: derived from the interface MTU, and lowered to
+    the MSS the peer announced in its SYN or SYN-ACK, if known (non-zero).
+*/
+static int path_mss(int ifindex, int family, uint16_t peer_mss)
+{
+    int mss, mtu;
+
+    mtu = if_mtu(ifindex);
+    if (mtu <= 0) {
+        mtu = 1500;
+    }
+
+    mss = mtu - (family == AF_INET6 ? 60 : 40);
+
+    if (peer_mss && peer_mss < mss) {
+        mss = peer_mss;
+    }
+
+    return mss < MSS_MIN ? MSS_MIN : mss;
+}
+
+
+/*
+    Send pkt_cnt packets, each gathered from its own iovecs, cnt times over,
+    batching as many messages per sendmmsg() call as possible.
+*/
+static int send_repeat(int sock_fd, struct sockaddr *addr, socklen_t addrlen,
+                       struct pkt_vec *pkts, int pkt_cnt, int cnt)
+{
+    int i, n, total, res;
+    struct mmsghdr msgs[SEND_BATCH];
+
+    total = pkt_cnt * cnt;
+
+    for (i = 0; i < total;) {
+        memset(msgs, 0, sizeof(msgs));
+        for (n = 0; n < SEND_BATCH && i + n < total; n++) {
+            msgs[n].msg_hdr.msg_name = addr;
+            msgs[n].msg_hdr.msg_namelen = addrlen;
+            msgs[n].msg_hdr.msg_iov = pkts[(i + n) % pkt_cnt].iov;
+            msgs[n].msg_hdr.msg_iovlen = pkts[(i + n) % pkt_cnt].iovcnt;
+        }
+
+        res = sendmmsg(sock_fd, msgs, n, 0);
+        if (res < 0) {
+            return -1;
+        }
+        i += res;
+    }
+
+    return 0;
+}
+
+
+static int send_packet(struct sockaddr_ll *sll, struct sockaddr *daddr,
+                       struct pkt_vec *pkts, int pkt_cnt, int cnt,
+                       int need_snat)
+{
+    int res, err, sock_fd;
+    socklen_t addrlen;
+
+    if (!need_snat) {
+        res = send_repeat(sockfd, (struct sockaddr *) sll, sizeof(*sll),
+                          pkts, pkt_cnt, cnt);
+        if (res < 0) {
+            E("ERROR: sendmmsg(): %s", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    sock_fd = fh_sockpool_acquire(sll->sll_ifindex, daddr->sa_family);
     if (sock_fd < 0) {
-        E("ERROR: socket(): %s", strerror(errno));
+        E(T(fh_sockpool_acquire));
         return -1;
     }
 
-    res = setsockopt(sock_fd, SOL_SOCKET, SO_BINDTODEVICE, iface,
-                     strlen(iface));
+    addrlen = daddr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                           : sizeof(struct sockaddr_in);
+
+    res = send_repeat(sock_fd, daddr, addrlen, pkts, pkt_cnt, cnt);
+    err = errno;
+
+    fh_sockpool_release();
+
     if (res < 0) {
-        E("ERROR: setsockopt(): SO_BINDTODEVICE: %s", strerror(errno));
-        goto close_socket;
+        E("ERROR: sendmmsg(): %s", strerror(err));
+        if (err == ENODEV || err == ENXIO) {
+            fh_sockpool_invalidate(sll->sll_ifindex);
+        }
+        return -1;
     }
 
-    res = setsockopt(sock_fd, SOL_SOCKET, SO_MARK, &g_ctx.fwmark,
-                     sizeof(g_ctx.fwmark));
+    return 0;
+}
+
+
+/*
+    Send packets already built in the first pkt_cnt reserved frames of the
+    TX ring, cnt times over.
+*/
+static int send_ring(struct sockaddr_ll *sll, struct pkt_vec *pkts,
+                     int pkt_cnt, int cnt)
+{
+    int i, total, res;
+    struct iovec *iov;
+
+    total = pkt_cnt * cnt;
+
+    for (i = 0; i < total; i++) {
+        iov = &pkts[i % pkt_cnt].iov[0];
+        if (i >= pkt_cnt) {
+            memcpy(th_txring_frame(i), iov->iov_base, iov->iov_len);
+        }
+        th_txring_fill(i, iov->iov_len);
+    }
+
+    res = th_txring_send(sll, total);
     if (res < 0) {
-        E("ERROR: setsockopt(): SO_MARK: %s", strerror(errno));
-        goto close_socket;
+        E(T(th_txring_send));
+        return -1;
     }
 
-    nbytes = sendto(sock_fd, pkt_buff, pkt_len, 0, daddr,
-                    daddr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
-                                                 : sizeof(struct sockaddr_in));
-    if (nbytes < 0) {
-        E("ERROR: sendto(): %s", strerror(errno));
-        goto close_socket;
+    return 0;
+}
+
+
+/*
+    Same as send_ring(), for frames acquired on an AF_XDP socket. The socket
+    is released in any case.
+*/
+static int send_xsk(struct fh_xsk *xsk, struct sockaddr_ll *sll,
+                    struct pkt_vec *pkts, int pkt_cnt, int cnt)
+{
+    int i, total, res;
+    struct iovec *iov;
+
+    total = pkt_cnt * cnt;
+
+    for (i = 0; i < total; i++) {
+        iov = &pkts[i % pkt_cnt].iov[0];
+        if (i >= pkt_cnt) {
+            memcpy(fh_xsk_frame(xsk, i), iov->iov_base, iov->iov_len);
+        }
+        fh_xsk_fill(xsk, i, iov->iov_len);
     }
 
-    ret = nbytes;
+    res = fh_xsk_send(xsk, sll, total);
+    if (res < 0) {
+        E(T(fh_xsk_send));
+        return -1;
+    }
+
+    return 0;
+}
 
-close_socket:
-    close(sock_fd);
 
-    return ret;
+/*
+    Point iov at the bytes [off, off + len) of the payload, as slices of its
+    pieces. Return the number of iovecs used.
+*/
+static int payload_slice(const struct fh_payload *payload, size_t off,
+                         size_t len, struct iovec *iov)
+{
+    int i, cnt;
+    size_t piece_len, n;
+
+    cnt = 0;
+    for (i = 0; i < payload->piece_cnt && len; i++) {
+        piece_len = payload->piece[i].iov_len;
+        if (off >= piece_len) {
+            off -= piece_len;
+            continue;
+        }
+        n = piece_len - off < len ? piece_len - off : len;
+        iov[cnt].iov_base = (uint8_t *) payload->piece[i].iov_base + off;
+        iov[cnt].iov_len = n;
+        cnt++;
+        len -= n;
+        off = 0;
+    }
+
+    return cnt;
 }
 
 
+/*
+    The fake packet is built once and then sent g_ctx.repeat times. Only the
+    headers are written here; the payload is sent straight from where the
+    payload module keeps its pieces, as further iovecs.
+    A payload larger than the MSS is split into consecutive segments, so
+    that it is never fragmented. peer_mss, if not 0, is the MSS the peer
+    announced in its SYN or SYN-ACK, which is honoured.
+    With --xdp or --tx-ring, the segments are built right inside the frames
+    of the AF_XDP UMEM or of the TX ring instead, as long as there is room
+    for them.
+*/
 static int send_payload(struct sockaddr_ll *sll, struct sockaddr *saddr,
                         struct sockaddr *daddr, uint8_t ttl, uint16_t sport_be,
                         uint16_t dport_be, uint32_t seq_be, uint32_t ackseq_be,
-                        int need_snat)
+                        const struct fh_payload *payload,
+                        uint16_t peer_mss, int need_snat)
 {
-    int pkt_len;
-    ssize_t nbytes;
-    uint8_t pkt_buff[1600] __attribute__((aligned));
-
-    if (daddr->sa_family == AF_INET) {
-        pkt_len = fh_pkt4_make(pkt_buff, sizeof(pkt_buff), saddr, daddr, ttl,
-                               sport_be, dport_be, seq_be, ackseq_be, 1,
-                               payload, payload_len);
-        if (pkt_len < 0) {
-            E(T(fh_pkt4_make));
-            return -1;
-        }
-    } else if (daddr->sa_family == AF_INET6) {
-        pkt_len = fh_pkt6_make(pkt_buff, sizeof(pkt_buff), saddr, daddr, ttl,
-                               sport_be, dport_be, seq_be, ackseq_be, 1,
-                               payload, payload_len);
-        if (pkt_len < 0) {
-            E(T(fh_pkt6_make));
-            return -1;
-        }
-    } else {
+    int res, hdr_len, mss, seg_cnt, i, j, last, use_ring, slice_cnt;
+    size_t off, seg_len, max_len, frame_cnt, pos, payload_len;
+    uint32_t seg_sum;
+    uint8_t *hdr;
+    struct fh_xsk *xsk;
+    struct iovec *slice;
+    uint8_t hdr_buff[SEG_MAX][64] __attribute__((aligned));
+    struct pkt_vec segs[SEG_MAX];
+    /* a header per segment, plus the pieces cut at segment boundaries */
+    struct iovec iovs[SEG_MAX * 2 + FH_PAYLOAD_PIECE_MAX];
+
+    if (daddr->sa_family != AF_INET && daddr->sa_family != AF_INET6) {
         E("ERROR: Unknown address family: %d", (int) saddr->sa_family);
         return -1;
     }
 
-    if (need_snat) {
-        nbytes = sendto_snat(sll, daddr, pkt_buff, pkt_len);
-        if (nbytes < 0) {
-            E(T(sendto_snat));
+    mss = path_mss(sll->sll_ifindex, daddr->sa_family, peer_mss);
+    payload_len = payload->len;
+
+    seg_cnt = payload_len ? (payload_len + mss - 1) / mss : 1;
+    if (seg_cnt > SEG_MAX) {
+        E("ERROR: payload of %zu bytes needs more than %d segments",
+          payload_len, SEG_MAX);
+        return -1;
+    }
+
+    max_len = sizeof(hdr_buff[0]) + (seg_cnt > 1 ? (size_t) mss : payload_len);
+    frame_cnt = (size_t) seg_cnt * g_ctx.repeat;
+
+    xsk = NULL;
+    if (g_ctx.use_xdp && !need_snat) {
+        xsk = fh_xsk_acquire(sll, frame_cnt, max_len);
+    }
+    use_ring = !xsk && g_ctx.tx_ring && !need_snat &&
+               th_txring_reserve(frame_cnt, max_len) == 0;
+
+    slice = iovs;
+    for (i = 0, off = 0; i < seg_cnt; i++, off += seg_len) {
+        last = i == seg_cnt - 1;
+        seg_len = last ? payload_len - off : (size_t) mss;
+
+        segs[i].iov = slice;
+        slice_cnt = payload_slice(payload, off, seg_len, slice + 1);
+
+        /* a single segment keeps the precomputed sum of the whole payload */
+        if (seg_cnt == 1) {
+            seg_sum = payload->sum;
+        } else {
+            seg_sum = 0;
+            for (j = 1, pos = 0; j <= slice_cnt; j++) {
+                seg_sum = fh_csum_add(seg_sum,
+                                      fh_csum_partial(slice[j].iov_base,
+                                                      slice[j].iov_len, 0),
+                                      pos);
+                pos += slice[j].iov_len;
+            }
+        }
+
+        if (xsk) {
+            hdr = fh_xsk_frame(xsk, i);
+        } else if (use_ring) {
+            hdr = th_txring_frame(i);
+        } else {
+            hdr = hdr_buff[i];
+        }
+
+        if (daddr->sa_family == AF_INET) {
+            hdr_len = fh_pkt4_make(hdr, sizeof(hdr_buff[i]), saddr, daddr,
+                                   ttl, sport_be, dport_be,
+                                   htonl(ntohl(seq_be) + off), ackseq_be,
+                                   last, seg_len, seg_sum);
+            if (hdr_len < 0) {
+                E(T(fh_pkt4_make));
+                goto release_xsk;
+            }
+        } else {
+            hdr_len = fh_pkt6_make(hdr, sizeof(hdr_buff[i]), saddr, daddr,
+                                   ttl, sport_be, dport_be,
+                                   htonl(ntohl(seq_be) + off), ackseq_be,
+                                   last, seg_len, seg_sum);
+            if (hdr_len < 0) {
+                E(T(fh_pkt6_make));
+                goto release_xsk;
+            }
+        }
+
+        slice[0].iov_base = hdr;
+        if (xsk || use_ring) {
+            for (j = 1, pos = hdr_len; j <= slice_cnt; j++) {
+                memcpy(hdr + pos, slice[j].iov_base, slice[j].iov_len);
+                pos += slice[j].iov_len;
+            }
+            slice[0].iov_len = hdr_len + seg_len;
+            segs[i].iovcnt = 1;
+        } else {
+            slice[0].iov_len = hdr_len;
+            segs[i].iovcnt = 1 + slice_cnt;
+        }
+        slice += segs[i].iovcnt;
+    }
+
+    if (xsk) {
+        res = send_xsk(xsk, sll, segs, seg_cnt, g_ctx.repeat);
+        if (res < 0) {
+            E(T(send_xsk));
             return -1;
         }
-    } else {
-        nbytes = sendto(sockfd, pkt_buff, pkt_len, 0, (struct sockaddr *) sll,
-                        sizeof(*sll));
-        if (nbytes < 0) {
-            E("ERROR: sendto(): %s", strerror(errno));
+        return 0;
+    }
+
+    if (use_ring) {
+        res = send_ring(sll, segs, seg_cnt, g_ctx.repeat);
+        if (res < 0) {
+            E(T(send_ring));
             return -1;
         }
+        return 0;
+    }
+
+    res = send_packet(sll, daddr, segs, seg_cnt, g_ctx.repeat, need_snat);
+    if (res < 0) {
+        E(T(send_packet));
+        return -1;
     }
 
     return 0;
+
+release_xsk:
+    if (xsk) {
+        fh_xsk_release(xsk);
+    }
+
+    return -1;
 }
 
 
@@ -301,8 +599,49 @@ int fh_rawsend_setup(void)
         goto close_socket;
     }
 
+    if (g_ctx.qdisc_bypass) {
+        opt = 1;
+        res = setsockopt(sockfd, SOL_PACKET, PACKET_QDISC_BYPASS, &opt,
+                         sizeof(opt));
+        if (res < 0) {
+            E("ERROR: setsockopt(): PACKET_QDISC_BYPASS: %s",
+              strerror(errno));
+            goto close_socket;
+        }
+    }
+
+    if (g_ctx.use_iptables) {
+        res = fh_sockpool_setup();
+        if (res < 0) {
+            E(T(fh_sockpool_setup));
+            goto close_socket;
+        }
+    }
+
+    if (g_ctx.tx_ring) {
+        res = fh_txring_setup();
+        if (res < 0) {
+            E(T(fh_txring_setup));
+            goto cleanup_sockpool;
+        }
+    }
+
+    if (g_ctx.use_xdp) {
+        res = fh_xsk_setup();
+        if (res < 0) {
+            E(T(fh_xsk_setup));
+            goto cleanup_txring;
+        }
+    }
+
     return 0;
 
+cleanup_txring:
+    fh_txring_cleanup();
+
+cleanup_sockpool:
+    fh_sockpool_cleanup();
+
 close_socket:
     close(sockfd);
 
@@ -312,6 +651,10 @@ close_socket:
 
 void fh_rawsend_cleanup(void)
 {
+    fh_xsk_cleanup();
+    fh_txring_cleanup();
+    fh_sockpool_cleanup();
+
     if (sockfd >= 0) {
         close(sockfd);
         sockfd = -1;
@@ -320,17 +663,19 @@ void fh_rawsend_cleanup(void)
 
 
 int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
-                      int *modified)
+                      int thr_hit, int *modified)
 {
     uint32_t seq_new, ack_new;
-    uint16_t ethertype;
-    int res, i, src_payload_len, hop, srcinfo_unavail;
+    uint16_t ethertype, peer_mss;
+    int res, src_payload_len, hop, srcinfo_unavail;
     uint8_t src_ttl, snd_ttl;
     struct tcphdr *tcph;
-    char src_ip_str[INET6_ADDRSTRLEN], dst_ip_str[INET6_ADDRSTRLEN];
+    struct pkt_vec orig;
+    struct iovec orig_iov;
+    struct fh_payload payload;
+    struct fh_flow_key key;
     struct sockaddr_storage saddr_store, daddr_store;
     struct sockaddr *saddr, *daddr;
-    ssize_t nbytes;
 
     *modified = 0;
 
@@ -340,14 +685,14 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
     ethertype = ntohs(sll->sll_protocol);
     if (g_ctx.use_ipv4 && ethertype == ETHERTYPE_IP) {
         res = fh_pkt4_parse(pkt_data, pkt_len, saddr, daddr, &src_ttl, &tcph,
-                            &src_payload_len);
+                            &src_payload_len, &key);
         if (res < 0) {
             E(T(fh_pkt4_parse));
             return -1;
         }
     } else if (g_ctx.use_ipv6 && ethertype == ETHERTYPE_IPV6) {
         res = fh_pkt6_parse(pkt_data, pkt_len, saddr, daddr, &src_ttl, &tcph,
-                            &src_payload_len);
+                            &src_payload_len, &key);
         if (res < 0) {
             E(T(fh_pkt6_parse));
             return -1;
@@ -357,11 +702,6 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         return -1;
     }
 
-    if (!g_ctx.silent) {
-        ipaddr_to_str(saddr, src_ip_str);
-        ipaddr_to_str(daddr, dst_ip_str);
-    }
-
     if (sll->sll_pkttype == PACKET_HOST && tcph->syn && tcph->ack) {
         /*
             Outbound TCP connection. SYN-ACK received from peer.
@@ -369,13 +709,22 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         sll->sll_pkttype = 0;
 
         if (!g_ctx.outbound) {
-            E_INFO("%s:%u ===SYN-ACK(~)===> %s:%u", src_ip_str,
-                   ntohs(tcph->source), dst_ip_str, ntohs(tcph->dest));
+            E_FLOW("===SYN-ACK(~)===>", 0, saddr, tcph->source, daddr,
+                   tcph->dest);
             return NF_ACCEPT;
         }
 
-        E_INFO("%s:%u ===SYN-ACK===> %s:%u", src_ip_str, ntohs(tcph->source),
-               dst_ip_str, ntohs(tcph->dest));
+        E_FLOW("===SYN-ACK===>", 0, saddr, tcph->source, daddr, tcph->dest);
+
+        /*
+            Fakes sent later in this connection honour the peer's MSS, too.
+        */
+        peer_mss = syn_mss(tcph);
+        res = fh_conntrack_learn_mss(&key, peer_mss);
+        if (res < 0) {
+            E(T(fh_conntrack_learn_mss));
+            return -1;
+        }
 
         ack_new = ntohl(tcph->seq);
         ack_new++;
@@ -386,25 +735,27 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         if (!g_ctx.nohopest) {
             hop = hop_estimate(src_ttl);
             if (hop <= g_ctx.ttl) {
-                E_INFO("%s:%u ===LOCAL(~)===> %s:%u", src_ip_str,
-                       ntohs(tcph->source), dst_ip_str, ntohs(tcph->dest));
+                E_FLOW("===LOCAL(~)===>", 0, saddr, tcph->source, daddr,
+                       tcph->dest);
                 return NF_ACCEPT;
             }
             snd_ttl = calc_snd_ttl(hop);
         }
 
-        th_payload_get(&payload, &payload_len);
+        res = th_payload_get(&payload);
+        if (res < 0) {
+            E(T(th_payload_get));
+            return -1;
+        }
 
-        for (i = 0; i < g_ctx.repeat; i++) {
-            res = send_payload(sll, daddr, saddr, snd_ttl, tcph->dest,
-                               tcph->source, tcph->ack_seq, ack_new, 0);
-            if (res < 0) {
-                E(T(send_payload));
-                return -1;
-            }
+        res = send_payload(sll, daddr, saddr, snd_ttl, tcph->dest,
+                           tcph->source, tcph->ack_seq, ack_new, &payload,
+                           peer_mss, 0);
+        if (res < 0) {
+            E(T(send_payload));
+            return -1;
         }
-        E_INFO("%s:%u <===FAKE(*)=== %s:%u", src_ip_str, ntohs(tcph->source),
-               dst_ip_str, ntohs(tcph->dest));
+        E_FLOW("<===FAKE(*)===", 0, saddr, tcph->source, daddr, tcph->dest);
 
         return NF_ACCEPT;
     } else if (sll->sll_pkttype == PACKET_OUTGOING && tcph->syn && tcph->ack) {
@@ -413,11 +764,12 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         */
         sll->sll_pkttype = 0;
 
-        srcinfo_unavail = fh_srcinfo_get(daddr, &src_ttl, sll->sll_addr);
+        srcinfo_unavail = fh_conntrack_srcinfo(&key, &src_ttl, &peer_mss,
+                                               sll->sll_addr);
 
         if (!g_ctx.inbound || srcinfo_unavail) {
-            E_INFO("%s:%u <===SYN-ACK(~)=== %s:%u", dst_ip_str,
-                   ntohs(tcph->dest), src_ip_str, ntohs(tcph->source));
+            E_FLOW("<===SYN-ACK(~)===", 0, daddr, tcph->dest, saddr,
+                   tcph->source);
             return NF_ACCEPT;
         }
 
@@ -430,26 +782,27 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         if (!g_ctx.nohopest) {
             hop = hop_estimate(src_ttl);
             if (hop <= g_ctx.ttl) {
-                E_INFO("%s:%u <===LOCAL(~)=== %s:%u", src_ip_str,
-                       ntohs(tcph->source), dst_ip_str, ntohs(tcph->dest));
+                E_FLOW("<===LOCAL(~)===", 0, saddr, tcph->source, daddr,
+                       tcph->dest);
                 return NF_ACCEPT;
             }
             snd_ttl = calc_snd_ttl(hop);
         }
 
-        th_payload_get(&payload, &payload_len);
+        res = th_payload_get(&payload);
+        if (res < 0) {
+            E(T(th_payload_get));
+            return -1;
+        }
 
-        for (i = 0; i < g_ctx.repeat; i++) {
-            res = send_payload(sll, saddr, daddr, snd_ttl, tcph->source,
-                               tcph->dest, seq_new, tcph->ack_seq,
-                               g_ctx.use_iptables /* needs SNAT */);
-            if (res < 0) {
-                E(T(send_payload));
-                return -1;
-            }
+        res = send_payload(sll, saddr, daddr, snd_ttl, tcph->source,
+                           tcph->dest, seq_new, tcph->ack_seq, &payload,
+                           peer_mss, g_ctx.use_iptables /* needs SNAT */);
+        if (res < 0) {
+            E(T(send_payload));
+            return -1;
         }
-        E_INFO("%s:%u <===FAKE(*)=== %s:%u", dst_ip_str, ntohs(tcph->dest),
-               src_ip_str, ntohs(tcph->source));
+        E_FLOW("<===FAKE(*)===", 0, daddr, tcph->dest, saddr, tcph->source);
 
         /*
             We send the original packet using a raw socket and discard the
@@ -459,23 +812,18 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
             it guarantees that our payload is always sent before the client's
             packet.
         */
-        if (g_ctx.use_iptables) {
-            nbytes = sendto_snat(sll, daddr, pkt_data, pkt_len);
-            if (nbytes < 0) {
-                E(T(sendto_snat));
-                return -1;
-            }
-        } else {
-            nbytes = sendto(sockfd, pkt_data, pkt_len, 0,
-                            (struct sockaddr *) sll, sizeof(*sll));
-            if (nbytes < 0) {
-                E("ERROR: sendto(): %s", strerror(errno));
-                return -1;
-            }
+        orig_iov.iov_base = pkt_data;
+        orig_iov.iov_len = pkt_len;
+        orig.iov = &orig_iov;
+        orig.iovcnt = 1;
+        res = send_packet(sll, daddr, &orig, 1, 1,
+                          g_ctx.use_iptables /* needs SNAT */);
+        if (res < 0) {
+            E(T(send_packet));
+            return -1;
         }
 
-        E_INFO("%s:%u <===SYN-ACK=== %s:%u", dst_ip_str, ntohs(tcph->dest),
-               src_ip_str, ntohs(tcph->source));
+        E_FLOW("<===SYN-ACK===", 0, daddr, tcph->dest, saddr, tcph->source);
 
         return NF_DROP; /* Drop it! */
     } else if (sll->sll_pkttype == PACKET_HOST && tcph->syn) {
@@ -485,23 +833,20 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         sll->sll_pkttype = 0;
 
         if (!g_ctx.inbound) {
-            E_INFO("%s:%u ===SYN(~)===> %s:%u", src_ip_str,
-                   ntohs(tcph->source), dst_ip_str, ntohs(tcph->dest));
+            E_FLOW("===SYN(~)===>", 0, saddr, tcph->source, daddr, tcph->dest);
             return NF_ACCEPT;
         }
 
-        *modified = !remove_tfo_cookie(ethertype, pkt_data, tcph);
+        *modified = !remove_tfo_cookie(tcph);
         if (*modified) {
-            E_INFO("%s:%u ===SYN(#)===> %s:%u", src_ip_str,
-                   ntohs(tcph->source), dst_ip_str, ntohs(tcph->dest));
+            E_FLOW("===SYN(#)===>", 0, saddr, tcph->source, daddr, tcph->dest);
         } else {
-            E_INFO("%s:%u ===SYN===> %s:%u", src_ip_str, ntohs(tcph->source),
-                   dst_ip_str, ntohs(tcph->dest));
+            E_FLOW("===SYN===>", 0, saddr, tcph->source, daddr, tcph->dest);
         }
 
-        res = fh_srcinfo_put(saddr, src_ttl, sll->sll_addr);
+        res = fh_conntrack_learn(&key, src_ttl, syn_mss(tcph), sll->sll_addr);
         if (res < 0) {
-            E(T(fh_srcinfo_put));
+            E(T(fh_conntrack_learn));
             return -1;
         }
 
@@ -513,18 +858,15 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         sll->sll_pkttype = 0;
 
         if (!g_ctx.outbound) {
-            E_INFO("%s:%u <===SYN(~)=== %s:%u", dst_ip_str, ntohs(tcph->dest),
-                   src_ip_str, ntohs(tcph->source));
+            E_FLOW("<===SYN(~)===", 0, daddr, tcph->dest, saddr, tcph->source);
             return NF_ACCEPT;
         }
 
-        *modified = !remove_tfo_cookie(ethertype, pkt_data, tcph);
+        *modified = !remove_tfo_cookie(tcph);
         if (*modified) {
-            E_INFO("%s:%u <===SYN(#)=== %s:%u", dst_ip_str, ntohs(tcph->dest),
-                   src_ip_str, ntohs(tcph->source));
+            E_FLOW("<===SYN(#)===", 0, daddr, tcph->dest, saddr, tcph->source);
         } else {
-            E_INFO("%s:%u <===SYN=== %s:%u", dst_ip_str, ntohs(tcph->dest),
-                   src_ip_str, ntohs(tcph->source));
+            E_FLOW("<===SYN===", 0, daddr, tcph->dest, saddr, tcph->source);
         }
 
         return NF_ACCEPT;
@@ -533,15 +875,24 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
          * 已建立的连接，检查是否需要发送伪造包
          */
         if (!(tcph->syn || tcph->fin || tcph->rst)) {
-            /* 普通数据包，增加计数 */
-            int should_send_fake = fh_conntrack_increment(
-                saddr, daddr, ntohs(tcph->source), ntohs(tcph->dest));
+            /*
+             * 普通数据包。由内核侧阈值规则选出的包直接视为达到阈值；
+             * 只有阈值规则不可用时（如离线回放），才由用户态计数决定。
+             * 两种情况都要从连接记录中取出对端的 MSS。
+             */
+            int should_send_fake = 0;
+
+            if (thr_hit || !g_ctx.thr_kernel) {
+                should_send_fake = fh_conntrack_increment(
+                    &key, FH_CONNTRACK_IN, &peer_mss, NULL, NULL, NULL);
+                if (thr_hit && should_send_fake >= 0) {
+                    should_send_fake = 1;
+                }
+            }
 
             if (should_send_fake == 1) {
                 /* 达到阈值，发送伪造包 */
                 if (g_ctx.outbound) {
-                    th_payload_get(&payload, &payload_len);
-
                     snd_ttl = g_ctx.ttl;
                     if (!g_ctx.nohopest) {
                         hop = hop_estimate(src_ttl);
@@ -557,47 +908,61 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
                     fake_ack += src_payload_len;
                     fake_ack = htonl(fake_ack);
 
-                    for (i = 0; i < g_ctx.repeat; i++) {
+                    res = th_payload_get(&payload);
+                    if (res < 0) {
+                        E(T(th_payload_get));
+                    } else {
                         res = send_payload(sll, daddr, saddr, snd_ttl,
                                            tcph->dest, tcph->source, fake_seq,
-                                           fake_ack, 0);
+                                           fake_ack, &payload, peer_mss, 0);
                         if (res < 0) {
                             E(T(send_payload));
                         }
                     }
-                    E_INFO("%s:%u <===FAKE(%" PRIu32 ")=== %s:%u", src_ip_str,
-                           ntohs(tcph->source), g_ctx.packet_threshold,
-                           dst_ip_str, ntohs(tcph->dest));
+                    E_FLOW("<===FAKE(%" PRIu32 ")===", g_ctx.packet_threshold,
+                           saddr, tcph->source, daddr, tcph->dest);
                 }
             } else if (should_send_fake < 0) {
                 E("ERROR: fh_conntrack_increment() failed");
             }
         } else if (tcph->fin || tcph->rst) {
             /* 连接关闭，清理跟踪 */
-            fh_conntrack_remove(saddr, daddr, ntohs(tcph->source),
-                                ntohs(tcph->dest));
+            fh_conntrack_remove(&key, FH_CONNTRACK_IN);
         }
 
-        E_INFO("%s:%u ===(~)===> %s:%u", src_ip_str, ntohs(tcph->source),
-               dst_ip_str, ntohs(tcph->dest));
+        E_FLOW("===(~)===>", 0, saddr, tcph->source, daddr, tcph->dest);
         return NF_ACCEPT;
     } else if (sll->sll_pkttype == PACKET_OUTGOING) {
         /*
          * 已建立的连接，检查是否需要发送伪造包
          */
         if (!(tcph->syn || tcph->fin || tcph->rst)) {
-            /* 普通数据包，增加计数 */
-            int should_send_fake = fh_conntrack_increment(
-                saddr, daddr, ntohs(tcph->source), ntohs(tcph->dest));
+            /*
+             * 普通数据包。由内核侧阈值规则选出的包直接视为达到阈值；
+             * 只有阈值规则不可用时（如离线回放），才由用户态计数决定。
+             */
+            int should_send_fake;
+
+            /* 计数与 SYN 信息在同一次查找中取出 */
+            srcinfo_unavail = 1;
+            if (thr_hit) {
+                should_send_fake = 1;
+                if (g_ctx.inbound) {
+                    srcinfo_unavail = fh_conntrack_srcinfo(
+                        &key, &src_ttl, &peer_mss, sll->sll_addr);
+                }
+            } else if (g_ctx.thr_kernel) {
+                should_send_fake = 0;
+            } else {
+                should_send_fake = fh_conntrack_increment(
+                    &key, FH_CONNTRACK_OUT, &peer_mss, &srcinfo_unavail,
+                    &src_ttl, sll->sll_addr);
+            }
 
             if (should_send_fake == 1) {
                 /* 达到阈值，发送伪造包 */
                 if (g_ctx.inbound) {
-                    srcinfo_unavail = fh_srcinfo_get(daddr, &src_ttl,
-                                                     sll->sll_addr);
                     if (!srcinfo_unavail) {
-                        th_payload_get(&payload, &payload_len);
-
                         snd_ttl = g_ctx.ttl;
                         if (!g_ctx.nohopest) {
                             hop = hop_estimate(src_ttl);
@@ -611,19 +976,21 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
                         /* 确认对端的包 */
                         uint32_t fake_ack = tcph->ack_seq;
 
-                        for (i = 0; i < g_ctx.repeat; i++) {
+                        res = th_payload_get(&payload);
+                        if (res < 0) {
+                            E(T(th_payload_get));
+                        } else {
                             res = send_payload(sll, saddr, daddr, snd_ttl,
                                                tcph->source, tcph->dest,
-                                               fake_seq, fake_ack,
-                                               g_ctx.use_iptables);
+                                               fake_seq, fake_ack, &payload,
+                                               peer_mss, g_ctx.use_iptables);
                             if (res < 0) {
                                 E(T(send_payload));
                             }
                         }
-                        E_INFO("%s:%u <===FAKE(%" PRIu32 ")=== %s:%u",
-                               dst_ip_str, ntohs(tcph->dest),
-                               g_ctx.packet_threshold, src_ip_str,
-                               ntohs(tcph->source));
+                        E_FLOW("<===FAKE(%" PRIu32 ")===",
+                               g_ctx.packet_threshold, daddr, tcph->dest,
+                               saddr, tcph->source);
                     }
                 }
             } else if (should_send_fake < 0) {
@@ -631,16 +998,13 @@ int fh_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
             }
         } else if (tcph->fin || tcph->rst) {
             /* 连接关闭，清理跟踪 */
-            fh_conntrack_remove(saddr, daddr, ntohs(tcph->source),
-                                ntohs(tcph->dest));
+            fh_conntrack_remove(&key, FH_CONNTRACK_OUT);
         }
 
-        E_INFO("%s:%u <===(~)=== %s:%u", dst_ip_str, ntohs(tcph->dest),
-               src_ip_str, ntohs(tcph->source));
+        E_FLOW("<===(~)===", 0, daddr, tcph->dest, saddr, tcph->source);
         return NF_ACCEPT;
     } else {
-        E_INFO("%s:%u ===(~)=== %s:%u", src_ip_str, ntohs(tcph->source),
-               dst_ip_str, ntohs(tcph->dest));
+        E_FLOW("===(~)===", 0, saddr, tcph->source, daddr, tcph->dest);
         return NF_ACCEPT;
     }
 }
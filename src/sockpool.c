@@ -0,0 +1,381 @@
+/*
+ * sockpool.c - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "sockpool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "globvar.h"
+#include "logging.h"
+
+/*
+    This is a workaround for iptables since it does not allow us to intercept
+    packets after POSTROUTING SNAT, which means the SNATed source address is
+    unknown.
+    Instead of using an AF_PACKET socket, we send through an AF_INET or
+    AF_INET6 raw socket bound to the interface, so that the packet gets SNATed
+    correctly. The sockets are opened on first use and kept until the
+    interface goes away, which is reported by an rtnetlink link monitor.
+*/
+struct snat_sock {
+    int ifindex;
+    int fd4;
+    int fd6;
+};
+
+static struct snat_sock *pool = NULL;
+static size_t pool_cnt = 0;
+static size_t pool_cap = 0;
+static pthread_rwlock_t pool_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int nl_fd = -1;
+static pthread_t monitor;
+static int monitor_started = 0;
+
+static struct snat_sock *find_sock(int ifindex)
+{
+    size_t i;
+
+    for (i = 0; i < pool_cnt; i++) {
+        if (pool[i].ifindex == ifindex) {
+            return &pool[i];
+        }
+    }
+    return NULL;
+}
+
+
+static int open_sock(int ifindex, int family)
+{
+    int res, sock_fd;
+    char *iface, iface_buf[IF_NAMESIZE];
+
+    iface = if_indextoname(ifindex, iface_buf);
+    if (!iface) {
+        E("ERROR: if_indextoname(): %s", strerror(errno));
+        return -1;
+    }
+
+    sock_fd = socket(family, SOCK_RAW, IPPROTO_RAW);
+    if (sock_fd < 0) {
+        E("ERROR: socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    res = setsockopt(sock_fd, SOL_SOCKET, SO_BINDTODEVICE, iface,
+                     strlen(iface));
+    if (res < 0) {
+        E("ERROR: setsockopt(): SO_BINDTODEVICE: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    res = setsockopt(sock_fd, SOL_SOCKET, SO_MARK, &g_ctx.fwmark,
+                     sizeof(g_ctx.fwmark));
+    if (res < 0) {
+        E("ERROR: setsockopt(): SO_MARK: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    return sock_fd;
+
+close_socket:
+    close(sock_fd);
+
+    return -1;
+}
+
+
+static void close_sock(struct snat_sock *s)
+{
+    if (s->fd4 >= 0) {
+        close(s->fd4);
+    }
+    if (s->fd6 >= 0) {
+        close(s->fd6);
+    }
+}
+
+
+/*
+    Caller must hold the write lock.
+*/
+static int get_sock_locked(int ifindex, int family)
+{
+    int *fdp;
+    size_t new_cap;
+    struct snat_sock *s, *new_pool;
+
+    s = find_sock(ifindex);
+    if (!s) {
+        if (pool_cnt == pool_cap) {
+            new_cap = pool_cap ? pool_cap * 2 : 8;
+            new_pool = realloc(pool, new_cap * sizeof(*pool));
+            if (!new_pool) {
+                E("ERROR: realloc(): %s", strerror(errno));
+                return -1;
+            }
+            pool = new_pool;
+            pool_cap = new_cap;
+        }
+        s = &pool[pool_cnt++];
+        s->ifindex = ifindex;
+        s->fd4 = -1;
+        s->fd6 = -1;
+    }
+
+    fdp = family == AF_INET6 ? &s->fd6 : &s->fd4;
+    if (*fdp < 0) {
+        *fdp = open_sock(ifindex, family);
+        if (*fdp < 0) {
+            E(T(open_sock));
+            return -1;
+        }
+    }
+
+    return *fdp;
+}
+
+
+static void remove_sock(int ifindex)
+{
+    struct snat_sock *s;
+
+    pthread_rwlock_wrlock(&pool_lock);
+
+    s = find_sock(ifindex);
+    if (s) {
+        close_sock(s);
+        *s = pool[--pool_cnt];
+    }
+
+    pthread_rwlock_unlock(&pool_lock);
+}
+
+
+static void flush_socks(void)
+{
+    size_t i;
+
+    pthread_rwlock_wrlock(&pool_lock);
+
+    for (i = 0; i < pool_cnt; i++) {
+        close_sock(&pool[i]);
+    }
+    pool_cnt = 0;
+
+    pthread_rwlock_unlock(&pool_lock);
+}
+
+
+static void *monitor_thread(void *arg)
+{
+    ssize_t len;
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifi;
+    uint8_t buff[8192] __attribute__((aligned));
+
+    (void) arg;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for (;;) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        len = recv(nl_fd, buff, sizeof(buff), 0);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (len < 0) {
+            switch (errno) {
+                case EINTR:
+                    continue;
+                case ENOBUFS:
+                    /*
+                        Some link events were lost. Drop everything and let
+                        the senders reopen what they need.
+                    */
+                    E("WARNING: rtnetlink events lost, flushing SNAT sockets");
+                    flush_socks();
+                    continue;
+                default:
+                    /*
+                        The link monitor is gone for good. From now on a
+                        socket of a removed interface is only dropped once
+                        a send on it fails, see fh_sockpool_invalidate().
+                    */
+                    E("ERROR: recv(): %s", strerror(errno));
+                    E("WARNING: link monitoring is disabled, "
+                      "flushing SNAT sockets");
+                    flush_socks();
+                    return NULL;
+            }
+        }
+
+        for (nlh = (struct nlmsghdr *) buff; NLMSG_OK(nlh, len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != RTM_DELLINK) {
+                continue;
+            }
+            ifi = NLMSG_DATA(nlh);
+            remove_sock(ifi->ifi_index);
+        }
+    }
+
+    return NULL;
+}
+
+
+int fh_sockpool_setup(void)
+{
+    int res;
+    sigset_t mask, oldmask;
+    struct sockaddr_nl addr;
+
+    nl_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (nl_fd < 0) {
+        E("ERROR: socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK;
+
+    res = bind(nl_fd, (struct sockaddr *) &addr, sizeof(addr));
+    if (res < 0) {
+        E("ERROR: bind(): %s", strerror(errno));
+        goto close_socket;
+    }
+
+    /*
+        Signals are handled by the main thread only.
+    */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    res = pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    if (res) {
+        E("ERROR: pthread_sigmask(): %s", strerror(res));
+        goto close_socket;
+    }
+
+    res = pthread_create(&monitor, NULL, &monitor_thread, NULL);
+    if (res) {
+        E("ERROR: pthread_create(): %s", strerror(res));
+        pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+        goto close_socket;
+    }
+    monitor_started = 1;
+
+    res = pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (res) {
+        E("ERROR: pthread_sigmask(): %s", strerror(res));
+        fh_sockpool_cleanup();
+        return -1;
+    }
+
+    return 0;
+
+close_socket:
+    close(nl_fd);
+    nl_fd = -1;
+
+    return -1;
+}
+
+
+void fh_sockpool_cleanup(void)
+{
+    if (monitor_started) {
+        pthread_cancel(monitor);
+        pthread_join(monitor, NULL);
+        monitor_started = 0;
+    }
+
+    if (nl_fd >= 0) {
+        close(nl_fd);
+        nl_fd = -1;
+    }
+
+    flush_socks();
+    free(pool);
+    pool = NULL;
+    pool_cap = 0;
+}
+
+
+/*
+    Returns the socket for the given interface and address family, opening it
+    if needed. On success the pool stays read-locked so that the monitor
+    cannot close the socket while it is in use; call fh_sockpool_release()
+    once done with it.
+*/
+int fh_sockpool_acquire(int ifindex, int family)
+{
+    int sock_fd;
+    struct snat_sock *s;
+
+    for (;;) {
+        pthread_rwlock_rdlock(&pool_lock);
+
+        s = find_sock(ifindex);
+        sock_fd = !s ? -1 : family == AF_INET6 ? s->fd6 : s->fd4;
+        if (sock_fd >= 0) {
+            return sock_fd;
+        }
+
+        pthread_rwlock_unlock(&pool_lock);
+
+        pthread_rwlock_wrlock(&pool_lock);
+        sock_fd = get_sock_locked(ifindex, family);
+        pthread_rwlock_unlock(&pool_lock);
+
+        if (sock_fd < 0) {
+            E(T(get_sock_locked));
+            return -1;
+        }
+    }
+}
+
+
+void fh_sockpool_release(void)
+{
+    pthread_rwlock_unlock(&pool_lock);
+}
+
+
+/*
+    Forget the sockets of an interface that is gone but not yet reported by
+    the monitor, so that the next packet opens fresh ones.
+*/
+void fh_sockpool_invalidate(int ifindex)
+{
+    remove_sock(ifindex);
+}
@@ -0,0 +1,328 @@
+/*
+ * txring.c - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "txring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+#include "globvar.h"
+#include "logging.h"
+
+/*
+    Optional transmit path through a memory-mapped PACKET_TX_RING (TPACKET_V3,
+    Linux 4.11 or later). Each thread owns a ring, so that frames are filled
+    without locking: fake packets are built right inside the frames, and a
+    single send() hands the whole batch to the kernel.
+    The rings are opened on first use and registered in a list, so that they
+    can be released at cleanup once the threads are gone.
+*/
+#define FRAME_SIZE 4096
+#define FRAMES_PER_BLOCK 16
+#define BLOCK_CNT 16
+#define FRAME_CNT (FRAMES_PER_BLOCK * BLOCK_CNT)
+
+/* packet data starts right after the frame header */
+#define DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct tx_ring {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    size_t head;
+    struct tx_ring *next;
+};
+
+static struct tx_ring *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct tx_ring *ring = NULL;
+static __thread int ring_failed = 0;
+
+static int open_ring(struct tx_ring *r)
+{
+    int res, opt;
+    struct tpacket_req3 req;
+
+    /*
+        Protocol 0: the socket only transmits and never queues anything for
+        reception.
+    */
+    r->fd = socket(AF_PACKET, SOCK_DGRAM, 0);
+    if (r->fd < 0) {
+        E("ERROR: socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    res = setsockopt(r->fd, SOL_SOCKET, SO_MARK, &g_ctx.fwmark,
+                     sizeof(g_ctx.fwmark));
+    if (res < 0) {
+        E("ERROR: setsockopt(): SO_MARK: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    opt = 7;
+    res = setsockopt(r->fd, SOL_SOCKET, SO_PRIORITY, &opt, sizeof(opt));
+    if (res < 0) {
+        E("ERROR: setsockopt(): SO_PRIORITY: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    if (g_ctx.qdisc_bypass) {
+        opt = 1;
+        res = setsockopt(r->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &opt,
+                         sizeof(opt));
+        if (res < 0) {
+            E("ERROR: setsockopt(): PACKET_QDISC_BYPASS: %s",
+              strerror(errno));
+            goto close_socket;
+        }
+    }
+
+    opt = TPACKET_V3;
+    res = setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &opt, sizeof(opt));
+    if (res < 0) {
+        E("ERROR: setsockopt(): PACKET_VERSION: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = FRAME_SIZE * FRAMES_PER_BLOCK;
+    req.tp_block_nr = BLOCK_CNT;
+    req.tp_frame_size = FRAME_SIZE;
+    req.tp_frame_nr = FRAME_CNT;
+
+    res = setsockopt(r->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req));
+    if (res < 0) {
+        E("ERROR: setsockopt(): PACKET_TX_RING: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    r->map_len = (size_t) req.tp_block_size * req.tp_block_nr;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  r->fd, 0);
+    if (r->map == MAP_FAILED) {
+        E("ERROR: mmap(): %s", strerror(errno));
+        goto close_socket;
+    }
+
+    r->head = 0;
+
+    return 0;
+
+close_socket:
+    close(r->fd);
+
+    return -1;
+}
+
+
+static void close_ring(struct tx_ring *r)
+{
+    munmap(r->map, r->map_len);
+    close(r->fd);
+}
+
+
+static struct tx_ring *get_ring(void)
+{
+    int res;
+    struct tx_ring *r;
+
+    if (ring || ring_failed) {
+        return ring;
+    }
+
+    r = malloc(sizeof(*r));
+    if (!r) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        ring_failed = 1;
+        return NULL;
+    }
+
+    res = open_ring(r);
+    if (res < 0) {
+        E(T(open_ring));
+        free(r);
+        /* stay on sendmmsg() in this thread */
+        ring_failed = 1;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+
+    ring = r;
+
+    return r;
+}
+
+
+/*
+    Drop the ring of this thread after a failed send(). The kernel may have
+    stopped in the middle of the batch, leaving its own position in the ring
+    unknown; a fresh ring is opened on next use.
+*/
+static void reset_ring(void)
+{
+    struct tx_ring **pp;
+
+    pthread_mutex_lock(&rings_lock);
+    for (pp = &rings; *pp; pp = &(*pp)->next) {
+        if (*pp == ring) {
+            *pp = ring->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    close_ring(ring);
+    free(ring);
+    ring = NULL;
+}
+
+
+static struct tpacket3_hdr *frame_hdr(size_t idx)
+{
+    size_t frame;
+
+    frame = (ring->head + idx) % FRAME_CNT;
+
+    return (struct tpacket3_hdr *) (ring->map + frame * FRAME_SIZE);
+}
+
+
+int fh_txring_setup(void)
+{
+    /*
+        Open the ring of the calling thread now, so that a kernel without
+        TX ring support is reported at startup.
+    */
+    if (!get_ring()) {
+        E(T(get_ring));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void fh_txring_cleanup(void)
+{
+    struct tx_ring *r, *next;
+
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r; r = next) {
+        next = r->next;
+        close_ring(r);
+        free(r);
+    }
+    rings = NULL;
+    pthread_mutex_unlock(&rings_lock);
+
+    ring = NULL;
+    ring_failed = 0;
+}
+
+
+/*
+    Check that the next frame_cnt frames of this thread's ring are free and
+    can hold frame_len bytes each. Returns -1 if the packets have to take
+    the regular path instead.
+*/
+int th_txring_reserve(size_t frame_cnt, size_t frame_len)
+{
+    size_t i;
+    uint32_t status;
+
+    if (!get_ring()) {
+        return -1;
+    }
+
+    if (frame_cnt > FRAME_CNT || frame_len > FRAME_SIZE - DATA_OFF) {
+        return -1;
+    }
+
+    for (i = 0; i < frame_cnt; i++) {
+        status = __atomic_load_n(&frame_hdr(i)->tp_status, __ATOMIC_ACQUIRE);
+        if (status != TP_STATUS_AVAILABLE) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+    Packet data of the idx-th reserved frame.
+*/
+uint8_t *th_txring_frame(size_t idx)
+{
+    return (uint8_t *) frame_hdr(idx) + DATA_OFF;
+}
+
+
+void th_txring_fill(size_t idx, size_t len)
+{
+    struct tpacket3_hdr *hdr;
+
+    hdr = frame_hdr(idx);
+    hdr->tp_next_offset = 0;
+    hdr->tp_len = len;
+}
+
+
+/*
+    Transmit the first frame_cnt reserved frames, which must all have been
+    filled. send() blocks until the kernel is done with them, after which
+    the frames are free again.
+*/
+int th_txring_send(struct sockaddr_ll *sll, size_t frame_cnt)
+{
+    size_t i;
+    ssize_t res;
+
+    for (i = 0; i < frame_cnt; i++) {
+        __atomic_store_n(&frame_hdr(i)->tp_status, TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
+    }
+
+    res = sendto(ring->fd, NULL, 0, 0, (struct sockaddr *) sll,
+                 sizeof(*sll));
+    if (res < 0) {
+        E("ERROR: sendto(): %s", strerror(errno));
+        reset_ring();
+        return -1;
+    }
+
+    ring->head = (ring->head + frame_cnt) % FRAME_CNT;
+
+    return 0;
+}
@@ -0,0 +1,504 @@
+/*
+ * uring.c - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "logging.h"
+
+/*
+    A minimal io_uring wrapper on top of the raw system calls, covering what
+    the queue workers need: multishot receives into a ring of provided
+    buffers, and sends that may be linked so that they are performed in
+    order. Multishot receive needs Linux 6.0; on older kernels, or when the
+    headers lack it, the workers keep using recvmmsg().
+*/
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#define FH_URING 1
+#endif
+
+#ifdef FH_URING
+
+/* buffer group of the provided buffers */
+#define BGID 0
+
+struct fh_uring {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;
+    struct io_uring_sqe *chain_tail;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *buf_base;
+    unsigned int buf_len;
+    unsigned int buf_mask;
+    uint16_t buf_tail;
+};
+
+static struct io_uring_sqe *get_sqe(struct fh_uring *ring)
+{
+    unsigned int head, idx;
+    struct io_uring_sqe *sqe;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    idx = ring->sq_local_tail & ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+
+struct fh_uring *fh_uring_create(unsigned int entries)
+{
+    struct fh_uring *ring;
+    struct io_uring_params params;
+    size_t sq_len, cq_len;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        E("ERROR: io_uring_setup(): %s", strerror(errno));
+        goto free_ring;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        E("ERROR: io_uring_setup(): %s", "IORING_FEAT_SINGLE_MMAP missing");
+        errno = ENOSYS;
+        goto close_ring;
+    }
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_len = params.cq_off.cqes +
+             params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->map_len = sq_len > cq_len ? sq_len : cq_len;
+
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->map == MAP_FAILED) {
+        E("ERROR: mmap(): %s", strerror(errno));
+        goto close_ring;
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        E("ERROR: mmap(): %s", strerror(errno));
+        goto unmap_ring;
+    }
+
+    ring->sq_head = (unsigned int *) (ring->map + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (ring->map + params.sq_off.tail);
+    ring->sq_array = (unsigned int *) (ring->map + params.sq_off.array);
+    ring->sq_mask = *(unsigned int *) (ring->map + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned int *) (ring->map + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (ring->map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *) (ring->map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ring->map + params.cq_off.cqes);
+
+    ring->br = MAP_FAILED;
+
+    return ring;
+
+unmap_ring:
+    munmap(ring->map, ring->map_len);
+
+close_ring:
+    close(ring->fd);
+
+free_ring:
+    free(ring);
+
+    return NULL;
+}
+
+
+void fh_uring_destroy(struct fh_uring *ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    /* closing the ring also unregisters the provided buffers */
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->map, ring->map_len);
+    close(ring->fd);
+
+    if (ring->br != MAP_FAILED) {
+        munmap(ring->br, ring->br_len);
+    }
+
+    free(ring);
+}
+
+
+/*
+    Hand buf_cnt buffers of buf_len bytes, laid out back to back at base, to
+    the kernel for multishot receives. buf_cnt must be a power of 2.
+*/
+int fh_uring_provide_bufs(struct fh_uring *ring, char *base,
+                          unsigned int buf_len, unsigned int buf_cnt)
+{
+    int res;
+    unsigned int i;
+    struct io_uring_buf_reg reg;
+
+    ring->br_len = buf_cnt * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED) {
+        E("ERROR: mmap(): %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->br;
+    reg.ring_entries = buf_cnt;
+    reg.bgid = BGID;
+
+    res = syscall(__NR_io_uring_register, ring->fd,
+                  IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (res < 0) {
+        E("ERROR: io_uring_register(): IORING_REGISTER_PBUF_RING: %s",
+          strerror(errno));
+        munmap(ring->br, ring->br_len);
+        ring->br = MAP_FAILED;
+        return -1;
+    }
+
+    ring->buf_base = base;
+    ring->buf_len = buf_len;
+    ring->buf_mask = buf_cnt - 1;
+    ring->buf_tail = 0;
+
+    for (i = 0; i < buf_cnt; i++) {
+        fh_uring_put_buf(ring, i << IORING_CQE_BUFFER_SHIFT);
+    }
+
+    return 0;
+}
+
+
+/*
+    The provided buffer a receive completion was written to.
+*/
+char *fh_uring_buf(struct fh_uring *ring, uint32_t cqe_flags)
+{
+    return ring->buf_base +
+           (size_t) (cqe_flags >> IORING_CQE_BUFFER_SHIFT) * ring->buf_len;
+}
+
+
+/*
+    Give the buffer of a receive completion back to the kernel.
+*/
+void fh_uring_put_buf(struct fh_uring *ring, uint32_t cqe_flags)
+{
+    uint16_t bid;
+    struct io_uring_buf *buf;
+
+    bid = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+
+    buf = &ring->br->bufs[ring->buf_tail & ring->buf_mask];
+    buf->addr = (uint64_t) (uintptr_t) (ring->buf_base +
+                                        (size_t) bid * ring->buf_len);
+    buf->len = ring->buf_len;
+    buf->bid = bid;
+
+    ring->buf_tail++;
+    __atomic_store_n(&ring->br->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+
+/*
+    Whether a multishot request stays armed after this completion.
+*/
+int fh_uring_more(uint32_t cqe_flags)
+{
+    return !!(cqe_flags & IORING_CQE_F_MORE);
+}
+
+
+int fh_uring_recv_multishot(struct fh_uring *ring, int fd,
+                            uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->user_data = user_data;
+
+    ring->chain_tail = NULL;
+
+    return 0;
+}
+
+
+/*
+    Queue a send(). With link set, it is only started once the previous
+    linked send of the same submission is done, whether or not that one
+    succeeded.
+*/
+int fh_uring_send(struct fh_uring *ring, int fd, const void *buf, size_t len,
+                  int link, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->user_data = user_data;
+
+    if (link && ring->chain_tail) {
+        ring->chain_tail->flags |= IOSQE_IO_HARDLINK;
+    }
+    ring->chain_tail = link ? sqe : NULL;
+
+    return 0;
+}
+
+
+/*
+    Number of requests that can still be queued before the next submission.
+*/
+int fh_uring_space(struct fh_uring *ring)
+{
+    unsigned int head;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return ring->sq_entries - (ring->sq_local_tail - head);
+}
+
+
+/*
+    Submit everything queued so far and wait for at least wait_nr
+    completions.
+*/
+int fh_uring_submit_wait(struct fh_uring *ring, unsigned int wait_nr)
+{
+    int res;
+    unsigned int to_submit;
+
+    ring->chain_tail = NULL;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sq_local_tail -
+                __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    res = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                  wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+    Take the next completion, if any. Returns 0 when there is none.
+*/
+int fh_uring_get_cqe(struct fh_uring *ring, struct fh_uring_cqe *cqe)
+{
+    unsigned int head;
+    struct io_uring_cqe *c;
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    c = &ring->cqes[head & ring->cq_mask];
+    cqe->user_data = c->user_data;
+    cqe->res = c->res;
+    cqe->flags = c->flags;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+#else
+
+struct fh_uring *fh_uring_create(unsigned int entries)
+{
+    (void) entries;
+
+    E("ERROR: io_uring_setup(): %s", strerror(ENOSYS));
+    errno = ENOSYS;
+
+    return NULL;
+}
+
+
+void fh_uring_destroy(struct fh_uring *ring)
+{
+    (void) ring;
+}
+
+
+int fh_uring_provide_bufs(struct fh_uring *ring, char *base,
+                          unsigned int buf_len, unsigned int buf_cnt)
+{
+    (void) ring;
+    (void) base;
+    (void) buf_len;
+    (void) buf_cnt;
+
+    errno = ENOSYS;
+
+    return -1;
+}
+
+
+char *fh_uring_buf(struct fh_uring *ring, uint32_t cqe_flags)
+{
+    (void) ring;
+    (void) cqe_flags;
+
+    return NULL;
+}
+
+
+void fh_uring_put_buf(struct fh_uring *ring, uint32_t cqe_flags)
+{
+    (void) ring;
+    (void) cqe_flags;
+}
+
+
+int fh_uring_more(uint32_t cqe_flags)
+{
+    (void) cqe_flags;
+
+    return 0;
+}
+
+
+int fh_uring_recv_multishot(struct fh_uring *ring, int fd,
+                            uint64_t user_data)
+{
+    (void) ring;
+    (void) fd;
+    (void) user_data;
+
+    errno = ENOSYS;
+
+    return -1;
+}
+
+
+int fh_uring_send(struct fh_uring *ring, int fd, const void *buf, size_t len,
+                  int link, uint64_t user_data)
+{
+    (void) ring;
+    (void) fd;
+    (void) buf;
+    (void) len;
+    (void) link;
+    (void) user_data;
+
+    errno = ENOSYS;
+
+    return -1;
+}
+
+
+int fh_uring_space(struct fh_uring *ring)
+{
+    (void) ring;
+
+    return 0;
+}
+
+
+int fh_uring_submit_wait(struct fh_uring *ring, unsigned int wait_nr)
+{
+    (void) ring;
+    (void) wait_nr;
+
+    errno = ENOSYS;
+
+    return -1;
+}
+
+
+int fh_uring_get_cqe(struct fh_uring *ring, struct fh_uring_cqe *cqe)
+{
+    (void) ring;
+    (void) cqe;
+
+    return 0;
+}
+
+#endif /* FH_URING */
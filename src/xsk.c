@@ -0,0 +1,578 @@
+/*
+ * xsk.c - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include "xsk.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_xdp.h>
+
+#include "globvar.h"
+#include "logging.h"
+
+/*
+    Optional transmit path through AF_XDP sockets (--xdp). Each interface
+    gets a transmit-only socket bound to its queue 0 in copy mode, which
+    works with any driver, veth included, and needs no XDP program. Fake
+    frames are built in the UMEM and queued on the TX ring; the kernel gives
+    them back through the completion ring once they are sent.
+    An interface where this fails, or which is not Ethernet, is remembered
+    and keeps using the AF_PACKET socket.
+*/
+#define FRAME_SIZE 2048
+#define FRAME_CNT 2048
+
+/* bind() insists on a fill ring, although nothing is ever received */
+#define FILL_CNT 64
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+struct xsk_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *desc;
+    uint32_t mask;
+    void *map;
+    size_t map_len;
+};
+
+struct fh_xsk {
+    int ifindex;
+    int fd;
+    int failed;
+    pthread_mutex_t lock;
+    uint8_t hwaddr[ETH_ALEN];
+    uint8_t *umem;
+    struct xsk_ring tx;
+    struct xsk_ring cq;
+    uint32_t tx_prod;
+    uint32_t free_cnt;
+    uint64_t free_addrs[FRAME_CNT];
+};
+
+static struct fh_xsk **xsks = NULL;
+static size_t xsks_cnt = 0;
+static size_t xsks_cap = 0;
+static pthread_mutex_t xsks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int map_ring(int fd, struct xdp_ring_offset *off, size_t desc_size,
+                    off_t pgoff, struct xsk_ring *ring)
+{
+    uint8_t *map;
+
+    ring->map_len = off->desc + FRAME_CNT * desc_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        E("ERROR: mmap(): %s", strerror(errno));
+        return -1;
+    }
+
+    map = ring->map;
+    ring->producer = (uint32_t *) (map + off->producer);
+    ring->consumer = (uint32_t *) (map + off->consumer);
+    ring->desc = map + off->desc;
+    ring->mask = FRAME_CNT - 1;
+
+    return 0;
+}
+
+
+static int get_hwaddr(int ifindex, uint8_t hwaddr[ETH_ALEN])
+{
+    int res, sock_fd;
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    if (!if_indextoname(ifindex, ifr.ifr_name)) {
+        E("ERROR: if_indextoname(): %s", strerror(errno));
+        return -1;
+    }
+
+    /* AF_XDP sockets do not pass interface ioctls through */
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0) {
+        E("ERROR: socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    res = ioctl(sock_fd, SIOCGIFHWADDR, &ifr);
+    close(sock_fd);
+    if (res < 0) {
+        E("ERROR: ioctl(): SIOCGIFHWADDR: %s", strerror(errno));
+        return -1;
+    }
+
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+        E("ERROR: %s is not an Ethernet interface", ifr.ifr_name);
+        return -1;
+    }
+
+    memcpy(hwaddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    return 0;
+}
+
+
+static int open_xsk(struct fh_xsk *x)
+{
+    int res, opt;
+    uint32_t i;
+    socklen_t opt_len;
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+
+    res = get_hwaddr(x->ifindex, x->hwaddr);
+    if (res < 0) {
+        E(T(get_hwaddr));
+        return -1;
+    }
+
+    x->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (x->fd < 0) {
+        E("ERROR: socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    x->umem = mmap(NULL, (size_t) FRAME_SIZE * FRAME_CNT,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                   0);
+    if (x->umem == MAP_FAILED) {
+        E("ERROR: mmap(): %s", strerror(errno));
+        goto close_socket;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t) (uintptr_t) x->umem;
+    reg.len = (uint64_t) FRAME_SIZE * FRAME_CNT;
+    reg.chunk_size = FRAME_SIZE;
+    reg.headroom = 0;
+
+    res = setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg));
+    if (res < 0) {
+        E("ERROR: setsockopt(): XDP_UMEM_REG: %s", strerror(errno));
+        goto unmap_umem;
+    }
+
+    opt = FILL_CNT;
+    res = setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &opt, sizeof(opt));
+    if (res < 0) {
+        E("ERROR: setsockopt(): XDP_UMEM_FILL_RING: %s", strerror(errno));
+        goto unmap_umem;
+    }
+
+    opt = FRAME_CNT;
+    res = setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &opt,
+                     sizeof(opt));
+    if (res < 0) {
+        E("ERROR: setsockopt(): XDP_UMEM_COMPLETION_RING: %s",
+          strerror(errno));
+        goto unmap_umem;
+    }
+
+    opt = FRAME_CNT;
+    res = setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &opt, sizeof(opt));
+    if (res < 0) {
+        E("ERROR: setsockopt(): XDP_TX_RING: %s", strerror(errno));
+        goto unmap_umem;
+    }
+
+    opt_len = sizeof(off);
+    res = getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &opt_len);
+    if (res < 0) {
+        E("ERROR: getsockopt(): XDP_MMAP_OFFSETS: %s", strerror(errno));
+        goto unmap_umem;
+    }
+
+    res = map_ring(x->fd, &off.tx, sizeof(struct xdp_desc),
+                   XDP_PGOFF_TX_RING, &x->tx);
+    if (res < 0) {
+        E(T(map_ring));
+        goto unmap_umem;
+    }
+
+    res = map_ring(x->fd, &off.cr, sizeof(uint64_t),
+                   XDP_UMEM_PGOFF_COMPLETION_RING, &x->cq);
+    if (res < 0) {
+        E(T(map_ring));
+        goto unmap_tx;
+    }
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_flags = XDP_COPY;
+    sxdp.sxdp_ifindex = x->ifindex;
+    sxdp.sxdp_queue_id = 0;
+
+    res = bind(x->fd, (struct sockaddr *) &sxdp, sizeof(sxdp));
+    if (res < 0) {
+        E("ERROR: bind(): %s", strerror(errno));
+        goto unmap_cq;
+    }
+
+    for (i = 0; i < FRAME_CNT; i++) {
+        x->free_addrs[i] = (uint64_t) i * FRAME_SIZE;
+    }
+    x->free_cnt = FRAME_CNT;
+    x->tx_prod = *x->tx.producer;
+
+    return 0;
+
+unmap_cq:
+    munmap(x->cq.map, x->cq.map_len);
+
+unmap_tx:
+    munmap(x->tx.map, x->tx.map_len);
+
+unmap_umem:
+    munmap(x->umem, (size_t) FRAME_SIZE * FRAME_CNT);
+
+close_socket:
+    close(x->fd);
+    x->fd = -1;
+
+    return -1;
+}
+
+
+static void close_xsk(struct fh_xsk *x)
+{
+    if (x->fd < 0) {
+        return;
+    }
+
+    munmap(x->cq.map, x->cq.map_len);
+    munmap(x->tx.map, x->tx.map_len);
+    close(x->fd);
+    x->fd = -1;
+    munmap(x->umem, (size_t) FRAME_SIZE * FRAME_CNT);
+}
+
+
+static struct fh_xsk *get_xsk(int ifindex)
+{
+    size_t i, new_cap;
+    struct fh_xsk *x, **new_xsks;
+
+    pthread_mutex_lock(&xsks_lock);
+
+    for (i = 0; i < xsks_cnt; i++) {
+        if (xsks[i]->ifindex == ifindex) {
+            x = xsks[i];
+            goto unlock;
+        }
+    }
+
+    if (xsks_cnt == xsks_cap) {
+        new_cap = xsks_cap ? xsks_cap * 2 : 8;
+        new_xsks = realloc(xsks, new_cap * sizeof(*xsks));
+        if (!new_xsks) {
+            E("ERROR: realloc(): %s", strerror(errno));
+            x = NULL;
+            goto unlock;
+        }
+        xsks = new_xsks;
+        xsks_cap = new_cap;
+    }
+
+    x = malloc(sizeof(*x));
+    if (!x) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        goto unlock;
+    }
+    x->ifindex = ifindex;
+    x->fd = -1;
+    x->failed = 0;
+    pthread_mutex_init(&x->lock, NULL);
+
+    xsks[xsks_cnt++] = x;
+
+unlock:
+    pthread_mutex_unlock(&xsks_lock);
+
+    return x;
+}
+
+
+/*
+    Caller must hold x->lock.
+*/
+static int ensure_open(struct fh_xsk *x)
+{
+    int res;
+
+    if (x->fd >= 0) {
+        return 0;
+    }
+
+    if (x->failed) {
+        return -1;
+    }
+
+    res = open_xsk(x);
+    if (res < 0) {
+        E(T(open_xsk));
+        E("WARNING: AF_XDP unavailable on interface %d, using AF_PACKET",
+          x->ifindex);
+        x->failed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+    Ask the kernel to process the TX ring. In copy mode it only takes a
+    limited batch per call.
+*/
+static int kick(struct fh_xsk *x)
+{
+    int i;
+    ssize_t res;
+
+    for (i = 0; i < 64; i++) {
+        if (__atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) == x->tx_prod) {
+            break;
+        }
+
+        res = sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        if (res < 0) {
+            switch (errno) {
+                case EAGAIN:
+                    continue;
+                case EBUSY:
+                case ENOBUFS:
+                    /* the rest goes out with the next kick */
+                    return 0;
+                default:
+                    return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+static void reclaim(struct fh_xsk *x)
+{
+    uint32_t cons, prod;
+    uint64_t *addrs;
+
+    addrs = x->cq.desc;
+    cons = *x->cq.consumer;
+    prod = __atomic_load_n(x->cq.producer, __ATOMIC_ACQUIRE);
+
+    for (; cons != prod; cons++) {
+        x->free_addrs[x->free_cnt++] = addrs[cons & x->cq.mask];
+    }
+
+    __atomic_store_n(x->cq.consumer, cons, __ATOMIC_RELEASE);
+}
+
+
+static uint32_t tx_space(struct fh_xsk *x)
+{
+    return FRAME_CNT - (x->tx_prod - __atomic_load_n(x->tx.consumer,
+                                                     __ATOMIC_ACQUIRE));
+}
+
+
+int fh_xsk_setup(void)
+{
+    int ifindex;
+    size_t i;
+    struct fh_xsk *x;
+
+    if (g_ctx.alliface) {
+        /* interfaces are picked up as packets show up */
+        return 0;
+    }
+
+    for (i = 0; g_ctx.iface[i]; i++) {
+        ifindex = if_nametoindex(g_ctx.iface[i]);
+        if (!ifindex) {
+            E("WARNING: if_nametoindex(): %s: %s", g_ctx.iface[i],
+              strerror(errno));
+            continue;
+        }
+
+        x = get_xsk(ifindex);
+        if (!x) {
+            E(T(get_xsk));
+            return -1;
+        }
+
+        pthread_mutex_lock(&x->lock);
+        ensure_open(x);
+        pthread_mutex_unlock(&x->lock);
+    }
+
+    return 0;
+}
+
+
+void fh_xsk_cleanup(void)
+{
+    size_t i;
+
+    pthread_mutex_lock(&xsks_lock);
+
+    for (i = 0; i < xsks_cnt; i++) {
+        close_xsk(xsks[i]);
+        pthread_mutex_destroy(&xsks[i]->lock);
+        free(xsks[i]);
+    }
+    free(xsks);
+    xsks = NULL;
+    xsks_cnt = xsks_cap = 0;
+
+    pthread_mutex_unlock(&xsks_lock);
+}
+
+
+/*
+    Lock the AF_XDP socket of the outgoing interface of sll, with room for
+    frame_cnt packets of frame_len bytes, not counting the Ethernet header.
+    Returns NULL if the packets have to take the AF_PACKET path instead.
+    Otherwise, the socket stays locked until fh_xsk_send() or
+    fh_xsk_release().
+*/
+struct fh_xsk *fh_xsk_acquire(struct sockaddr_ll *sll, size_t frame_cnt,
+                              size_t frame_len)
+{
+    int res;
+    struct fh_xsk *x;
+
+    if (frame_len + ETH_HLEN > FRAME_SIZE || frame_cnt > FRAME_CNT) {
+        return NULL;
+    }
+
+    x = get_xsk(sll->sll_ifindex);
+    if (!x) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&x->lock);
+
+    res = ensure_open(x);
+    if (res < 0) {
+        goto unlock;
+    }
+
+    reclaim(x);
+    if (x->free_cnt < frame_cnt || tx_space(x) < frame_cnt) {
+        kick(x);
+        reclaim(x);
+        if (x->free_cnt < frame_cnt || tx_space(x) < frame_cnt) {
+            goto unlock;
+        }
+    }
+
+    return x;
+
+unlock:
+    pthread_mutex_unlock(&x->lock);
+
+    return NULL;
+}
+
+
+/*
+    Room for the IP packet in the idx-th acquired frame, right after the
+    Ethernet header.
+*/
+uint8_t *fh_xsk_frame(struct fh_xsk *x, size_t idx)
+{
+    return x->umem + x->free_addrs[x->free_cnt - 1 - idx] + ETH_HLEN;
+}
+
+
+void fh_xsk_fill(struct fh_xsk *x, size_t idx, size_t len)
+{
+    struct xdp_desc *desc;
+
+    desc = (struct xdp_desc *) x->tx.desc + ((x->tx_prod + idx) &
+                                             x->tx.mask);
+    desc->addr = x->free_addrs[x->free_cnt - 1 - idx];
+    desc->len = len + ETH_HLEN;
+    desc->options = 0;
+}
+
+
+/*
+    Transmit the first frame_cnt acquired frames, which must all have been
+    filled, and unlock the socket.
+*/
+int fh_xsk_send(struct fh_xsk *x, struct sockaddr_ll *sll, size_t frame_cnt)
+{
+    int res;
+    size_t i;
+    struct ether_header *eth;
+
+    for (i = 0; i < frame_cnt; i++) {
+        eth = (struct ether_header *) (fh_xsk_frame(x, i) - ETH_HLEN);
+        memcpy(eth->ether_dhost, sll->sll_addr, ETH_ALEN);
+        memcpy(eth->ether_shost, x->hwaddr, ETH_ALEN);
+        eth->ether_type = sll->sll_protocol;
+    }
+
+    x->free_cnt -= frame_cnt;
+    x->tx_prod += frame_cnt;
+    __atomic_store_n(x->tx.producer, x->tx_prod, __ATOMIC_RELEASE);
+
+    res = kick(x);
+    if (res < 0) {
+        E("ERROR: sendto(): %s", strerror(errno));
+        if (errno == ENODEV || errno == ENXIO || errno == ENETDOWN) {
+            /* reopened on next use */
+            close_xsk(x);
+        }
+    }
+
+    pthread_mutex_unlock(&x->lock);
+
+    return res;
+}
+
+
+void fh_xsk_release(struct fh_xsk *x)
+{
+    pthread_mutex_unlock(&x->lock);
+}
@@ -0,0 +1,129 @@
+/*
+ * csumbench.c - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+    fakehttp-csumbench: compare the TCP checksum of src/csum.c, in each
+    implementation this CPU supports, against the libnetfilter_queue
+    routine it replaces.
+*/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <libnetfilter_queue/libnetfilter_queue_tcp.h>
+
+#include "csum.h"
+
+#define PKT_MAX 6040
+
+static const size_t sizes[] = {0, 64, 256, 576, 1460, 6000};
+static const char *impl_names[] = {"scalar", "sse2", "avx2"};
+
+static volatile uint16_t sink;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint16_t fh_tcp4_check(struct iphdr *iph, struct tcphdr *tcph,
+                              size_t tcp_len)
+{
+    uint32_t sum;
+
+    tcph->check = 0;
+    sum = fh_csum_partial(&iph->saddr, 2 * sizeof(iph->saddr), 0);
+    sum += htons(IPPROTO_TCP) + htons(tcp_len);
+    sum = fh_csum_partial(tcph, tcp_len, sum);
+    return fh_csum_fold(sum);
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long i, iters;
+    size_t s, k, tcp_len;
+    uint8_t pkt[PKT_MAX] __attribute__((aligned(8)));
+    struct iphdr *iph;
+    struct tcphdr *tcph;
+    uint16_t expect;
+    double t0, base, dt;
+
+    iters = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+    if (!iters) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(1);
+    for (i = 0; i < sizeof(pkt); i++) {
+        pkt[i] = rand();
+    }
+
+    iph = (struct iphdr *) pkt;
+    tcph = (struct tcphdr *) (pkt + sizeof(*iph));
+    iph->version = 4;
+    iph->ihl = sizeof(*iph) / 4;
+    iph->protocol = IPPROTO_TCP;
+    tcph->doff = sizeof(*tcph) / 4;
+
+    printf("%-8s %-8s %10s %8s\n", "payload", "impl", "ns/pkt", "speedup");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        tcp_len = sizeof(*tcph) + sizes[s];
+        iph->tot_len = htons(sizeof(*iph) + tcp_len);
+
+        t0 = now();
+        for (i = 0; i < iters; i++) {
+            nfq_tcp_compute_checksum_ipv4(tcph, iph);
+            sink = tcph->check;
+        }
+        base = (now() - t0) / iters * 1e9;
+        expect = tcph->check;
+        printf("%-8zu %-8s %10.1f %8s\n", sizes[s], "nfq", base, "1.00x");
+
+        for (k = 0; k < sizeof(impl_names) / sizeof(impl_names[0]); k++) {
+            if (fh_csum_use(impl_names[k]) < 0) {
+                continue;
+            }
+
+            t0 = now();
+            for (i = 0; i < iters; i++) {
+                sink = fh_tcp4_check(iph, tcph, tcp_len);
+            }
+            dt = (now() - t0) / iters * 1e9;
+
+            tcph->check = sink;
+            printf("%-8zu %-8s %10.1f %7.2fx%s\n", sizes[s], impl_names[k],
+                   dt, base / dt, sink == expect ? "" : "  MISMATCH");
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
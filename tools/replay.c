@@ -0,0 +1,794 @@
+/*
+ * replay.c - FakeHTTP: https://github.com/MikeWang000000/FakeHTTP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+    fakehttp-replay: feed the packets of a pcap file through
+    fh_rawsend_handle() without NFQUEUE, raw sockets or root.
+
+    The sockaddr_ll metadata that callback() in nfqueue.c would build is
+    synthesized from the capture. The transmit side is stubbed at link time
+    (-Wl,--wrap), so generated packets are only counted, or written to a pcap
+    file with -o.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <linux/netfilter.h>
+
+#include "conntrack.h"
+#include "csum.h"
+#include "globvar.h"
+#include "logging.h"
+#include "payload.h"
+#include "prng.h"
+#include "rawsend.h"
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+/* long-only options */
+#define OPT_SEED 256
+
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define REPLAY_IFINDEX  1
+#define PLINFO_MAX      32
+#define PKTTYPE_UNKNOWN 0xff
+/* largest IP packet handed to fh_rawsend_handle() */
+#define PKT_MAX         (UINT16_MAX + 1)
+
+struct pcap_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+struct replay_pkt {
+    struct sockaddr_ll sll;
+    uint8_t *data;
+    int len;
+};
+
+static struct replay_pkt *pkts = NULL;
+static size_t pkts_cnt = 0;
+
+static FILE *out_fp = NULL;
+static unsigned long long sent_pkts = 0, sent_bytes = 0;
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <pcap>\n"
+            "\n"
+            "Options:\n"
+            "  -0                 process inbound connections\n"
+            "  -1                 process outbound connections\n"
+            "  -b <file>          use TCP payload from binary file\n"
+            "  -e <hostname>      hostname for HTTPS obfuscation\n"
+            "  -g                 disable hop count estimation\n"
+            "  -h <hostname>      hostname for HTTP obfuscation\n"
+            "  -l <address>       local address (default: source of the first "
+            "SYN)\n"
+            "  -n <count>         replay the capture <count> times "
+            "(default: 1)\n"
+            "  -o <file>          write generated packets to a pcap file\n"
+            "  -r <repeat>        duplicate generated packets for <repeat> "
+            "times\n"
+            "  -T <number>        send fakes once per direction, at its "
+            "<number>th packet\n"
+            "                     (2 or more, default: 100)\n"
+            "  -t <ttl>           TTL for generated packets\n"
+            "  -v                 print every packet\n"
+            "  -z                 use iptables SNAT send path\n"
+            "  --seed <number>    fixed random seed, for reproducible runs\n"
+            "\n",
+            name);
+}
+
+
+/*
+    Transmit stubs. rawsend.o is linked with -Wl,--wrap=..., so its calls
+    land here instead of the kernel.
+*/
+int __wrap_sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+                    int flags)
+{
+    unsigned int i;
+    size_t j, len;
+    struct msghdr *msg;
+    struct pcap_rec_hdr rec;
+    struct timespec ts;
+
+    (void) sockfd;
+    (void) flags;
+
+    for (i = 0; i < vlen; i++) {
+        msg = &msgvec[i].msg_hdr;
+
+        len = 0;
+        for (j = 0; j < msg->msg_iovlen; j++) {
+            len += msg->msg_iov[j].iov_len;
+        }
+
+        sent_pkts++;
+        sent_bytes += len;
+        msgvec[i].msg_len = len;
+
+        if (out_fp) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            rec.ts_sec = ts.tv_sec;
+            rec.ts_frac = ts.tv_nsec / 1000;
+            rec.incl_len = rec.orig_len = len;
+            fwrite(&rec, sizeof(rec), 1, out_fp);
+            for (j = 0; j < msg->msg_iovlen; j++) {
+                fwrite(msg->msg_iov[j].iov_base, 1, msg->msg_iov[j].iov_len,
+                       out_fp);
+            }
+        }
+    }
+
+    return vlen;
+}
+
+
+int __wrap_fh_sockpool_acquire(int ifindex, int family)
+{
+    (void) ifindex;
+    (void) family;
+
+    return 0; /* never used, __wrap_sendmmsg() ignores the socket */
+}
+
+
+void __wrap_fh_sockpool_release(void)
+{
+}
+
+
+static int read_file(const char *path, uint8_t **buff_ptr, size_t *len_ptr)
+{
+    FILE *fp;
+    long size;
+    uint8_t *buff;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        E("ERROR: fopen(): %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) < 0) {
+        E("ERROR: fseek(): %s: %s", path, strerror(errno));
+        goto close_file;
+    }
+
+    buff = malloc(size ? size : 1);
+    if (!buff) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        goto close_file;
+    }
+
+    if (fread(buff, 1, size, fp) != (size_t) size) {
+        E("ERROR: fread(): %s: short read", path);
+        free(buff);
+        goto close_file;
+    }
+
+    fclose(fp);
+
+    *buff_ptr = buff;
+    *len_ptr = size;
+
+    return 0;
+
+close_file:
+    fclose(fp);
+
+    return -1;
+}
+
+
+static uint32_t swap32(uint32_t x, int swapped)
+{
+    return swapped ? __builtin_bswap32(x) : x;
+}
+
+
+static uint16_t get_be16(uint8_t *p)
+{
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+
+/*
+    Strip the link layer header. Returns the offset of the IP header, or -1
+    if the frame is not an IPv4/IPv6 TCP packet.
+*/
+static int link_strip(uint32_t linktype, uint8_t *frame, size_t len,
+                      struct sockaddr_ll *sll)
+{
+    size_t off;
+    uint16_t ethertype, pkttype;
+
+    memset(sll, 0, sizeof(*sll));
+    sll->sll_family = AF_PACKET;
+    sll->sll_ifindex = REPLAY_IFINDEX;
+    sll->sll_pkttype = PKTTYPE_UNKNOWN; /* decided by set_direction() */
+
+    switch (linktype) {
+        case LINKTYPE_ETHERNET:
+            if (len < 14) {
+                return -1;
+            }
+            sll->sll_halen = 6;
+            memcpy(sll->sll_addr, frame + 6, 6); /* source MAC */
+            ethertype = get_be16(frame + 12);
+            off = 14;
+            while ((ethertype == 0x8100 || ethertype == 0x88a8) &&
+                   len >= off + 4) {
+                ethertype = get_be16(frame + off + 2);
+                off += 4;
+            }
+            break;
+
+        case LINKTYPE_LINUX_SLL:
+            if (len < 16) {
+                return -1;
+            }
+            pkttype = get_be16(frame);
+            sll->sll_pkttype = pkttype == PACKET_OUTGOING ? PACKET_OUTGOING
+                                                          : PACKET_HOST;
+            sll->sll_halen = get_be16(frame + 4) > 8 ? 8 : get_be16(frame + 4);
+            memcpy(sll->sll_addr, frame + 6, sll->sll_halen);
+            ethertype = get_be16(frame + 14);
+            off = 16;
+            break;
+
+        case LINKTYPE_LINUX_SLL2:
+            if (len < 20) {
+                return -1;
+            }
+            ethertype = get_be16(frame);
+            sll->sll_pkttype = frame[10] == PACKET_OUTGOING ? PACKET_OUTGOING
+                                                            : PACKET_HOST;
+            sll->sll_halen = frame[11] > 8 ? 8 : frame[11];
+            memcpy(sll->sll_addr, frame + 12, sll->sll_halen);
+            off = 20;
+            break;
+
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            if (len < 1) {
+                return -1;
+            }
+            ethertype = (frame[0] >> 4) == 6 ? ETHERTYPE_IPV6 : ETHERTYPE_IP;
+            off = 0;
+            break;
+
+        default:
+            return -1;
+    }
+
+    sll->sll_protocol = htons(ethertype);
+
+    /* no hardware address on POSTROUTING packets */
+    if (sll->sll_pkttype == PACKET_OUTGOING) {
+        sll->sll_halen = 0;
+        memset(sll->sll_addr, 0, sizeof(sll->sll_addr));
+    }
+
+    if (ethertype == ETHERTYPE_IP) {
+        if (len < off + 20 || frame[off + 9] != IPPROTO_TCP) {
+            return -1;
+        }
+    } else if (ethertype == ETHERTYPE_IPV6) {
+        if (len < off + 40 || frame[off + 6] != IPPROTO_TCP) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+
+    return off;
+}
+
+
+static int parse_local(const char *str, uint8_t addr[16], int *family)
+{
+    if (inet_pton(AF_INET, str, addr) == 1) {
+        *family = AF_INET;
+        return 0;
+    }
+    if (inet_pton(AF_INET6, str, addr) == 1) {
+        *family = AF_INET6;
+        return 0;
+    }
+    return -1;
+}
+
+
+/*
+    Packets sent by the local address are PACKET_OUTGOING, everything else is
+    PACKET_HOST, just like the in/out interface index seen by callback().
+*/
+static void set_direction(struct replay_pkt *pkt, const uint8_t local[16],
+                          int local_family)
+{
+    uint8_t *src;
+    size_t alen;
+
+    if (ntohs(pkt->sll.sll_protocol) == ETHERTYPE_IPV6) {
+        src = pkt->data + 8;
+        alen = 16;
+        if (local_family != AF_INET6) {
+            pkt->sll.sll_pkttype = PACKET_HOST;
+            return;
+        }
+    } else {
+        src = pkt->data + 12;
+        alen = 4;
+        if (local_family != AF_INET) {
+            pkt->sll.sll_pkttype = PACKET_HOST;
+            return;
+        }
+    }
+
+    if (memcmp(src, local, alen) == 0) {
+        pkt->sll.sll_pkttype = PACKET_OUTGOING;
+        /* no hardware address on POSTROUTING packets */
+        pkt->sll.sll_halen = 0;
+        memset(pkt->sll.sll_addr, 0, sizeof(pkt->sll.sll_addr));
+    } else {
+        pkt->sll.sll_pkttype = PACKET_HOST;
+    }
+}
+
+
+static int guess_local(uint8_t local[16], int *local_family)
+{
+    size_t i, iph_len;
+    uint8_t *d, flags;
+
+    for (i = 0; i < pkts_cnt; i++) {
+        d = pkts[i].data;
+        if (ntohs(pkts[i].sll.sll_protocol) == ETHERTYPE_IPV6) {
+            iph_len = 40;
+        } else {
+            iph_len = (d[0] & 0x0f) * 4;
+        }
+        if ((size_t) pkts[i].len < iph_len + 14) {
+            continue;
+        }
+        flags = d[iph_len + 13];
+        if ((flags & 0x12) == 0x02 /* SYN without ACK */) {
+            if (iph_len == 40) {
+                memcpy(local, d + 8, 16);
+                *local_family = AF_INET6;
+            } else {
+                memcpy(local, d + 12, 4);
+                *local_family = AF_INET;
+            }
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+static int load_pcap(uint8_t *buff, size_t len)
+{
+    int swapped, off;
+    size_t pos, cap, oversized;
+    uint32_t linktype, incl_len;
+    struct pcap_hdr *hdr;
+    struct pcap_rec_hdr *rec;
+    struct replay_pkt *new_pkts;
+
+    if (len < sizeof(*hdr)) {
+        E("ERROR: not a pcap file");
+        return -1;
+    }
+
+    hdr = (struct pcap_hdr *) buff;
+    if (hdr->magic == PCAP_MAGIC || hdr->magic == PCAP_MAGIC_NSEC) {
+        swapped = 0;
+    } else if (hdr->magic == __builtin_bswap32(PCAP_MAGIC) ||
+               hdr->magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+        swapped = 1;
+    } else {
+        E("ERROR: not a pcap file (pcapng is not supported)");
+        return -1;
+    }
+
+    linktype = swap32(hdr->linktype, swapped) & 0x0fffffff;
+
+    cap = 0;
+    oversized = 0;
+    pos = sizeof(*hdr);
+    while (pos + sizeof(*rec) <= len) {
+        rec = (struct pcap_rec_hdr *) (buff + pos);
+        pos += sizeof(*rec);
+        incl_len = swap32(rec->incl_len, swapped);
+        if (incl_len > len - pos) {
+            E("WARNING: truncated pcap record, stopping");
+            break;
+        }
+
+        if (pkts_cnt == cap) {
+            cap = cap ? cap * 2 : 1024;
+            new_pkts = realloc(pkts, cap * sizeof(*pkts));
+            if (!new_pkts) {
+                E("ERROR: realloc(): %s", strerror(errno));
+                return -1;
+            }
+            pkts = new_pkts;
+        }
+
+        off = link_strip(linktype, buff + pos, incl_len,
+                         &pkts[pkts_cnt].sll);
+        /* GRO/TSO super-packets and malformed records do not fit */
+        if (off >= 0 && incl_len - off > PKT_MAX) {
+            oversized++;
+        } else if (off >= 0) {
+            pkts[pkts_cnt].data = buff + pos + off;
+            pkts[pkts_cnt].len = incl_len - off;
+            pkts_cnt++;
+        }
+
+        pos += incl_len;
+    }
+
+    if (oversized) {
+        E("WARNING: %zu records larger than %d bytes skipped", oversized,
+          PKT_MAX);
+    }
+
+    return 0;
+}
+
+
+static int out_setup(const char *path)
+{
+    struct pcap_hdr hdr;
+
+    out_fp = fopen(path, "wb");
+    if (!out_fp) {
+        E("ERROR: fopen(): %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.snaplen = UINT16_MAX;
+    hdr.linktype = LINKTYPE_RAW;
+    fwrite(&hdr, sizeof(hdr), 1, out_fp);
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long long tmp, loops, l, accepts, drops, errors, modified_cnt;
+    int res, opt, exitcode, modified, local_family, verdict;
+    size_t i, plinfo_cnt, in_len;
+    uint8_t *in_buff, local[16], pkt_buff[PKT_MAX];
+    char *endptr;
+    const char *local_str, *out_path;
+    struct payload_info plinfo[PLINFO_MAX + 1];
+    struct sockaddr_ll sll;
+    struct timespec t0, t1;
+    double elapsed, total;
+    static const struct option long_opts[] = {
+        {"seed", required_argument, NULL, OPT_SEED}, {NULL, 0, NULL, 0}};
+
+    exitcode = EXIT_FAILURE;
+    in_buff = NULL;
+    local_str = out_path = NULL;
+    loops = 1;
+    plinfo_cnt = 0;
+    memset(plinfo, 0, sizeof(plinfo));
+    accepts = drops = errors = modified_cnt = 0;
+
+    g_ctx.silent = 1;
+    g_ctx.logfp = stderr;
+
+    while ((opt = getopt_long(argc, argv, "01b:e:gh:l:n:o:r:T:t:vz",
+                              long_opts, NULL)) != -1) {
+        switch (opt) {
+            case '0':
+                g_ctx.inbound = 1;
+                break;
+
+            case '1':
+                g_ctx.outbound = 1;
+                break;
+
+            case 'b':
+            case 'e':
+            case 'h':
+                if (plinfo_cnt >= PLINFO_MAX) {
+                    fprintf(stderr, "%s: too many payloads.\n", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                plinfo[plinfo_cnt].type = opt == 'b'   ? FH_PAYLOAD_CUSTOM
+                                          : opt == 'e' ? FH_PAYLOAD_HTTPS
+                                                       : FH_PAYLOAD_HTTP;
+                plinfo[plinfo_cnt].info = optarg;
+                plinfo_cnt++;
+                break;
+
+            case 'g':
+                g_ctx.nohopest = 1;
+                break;
+
+            case 'l':
+                local_str = optarg;
+                break;
+
+            case 'n':
+                tmp = strtoull(optarg, NULL, 0);
+                if (!tmp) {
+                    fprintf(stderr, "%s: invalid value for -n.\n", argv[0]);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                loops = tmp;
+                break;
+
+            case 'o':
+                out_path = optarg;
+                break;
+
+            case 'r':
+                tmp = strtoull(optarg, NULL, 0);
+                if (!tmp || tmp > FH_RAWSEND_REPEAT_MAX) {
+                    fprintf(stderr, "%s: invalid value for -r.\n", argv[0]);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                g_ctx.repeat = tmp;
+                break;
+
+            case 'T':
+                tmp = strtoull(optarg, NULL, 0);
+                if (tmp < 2 || tmp > UINT32_MAX) {
+                    fprintf(stderr, "%s: invalid value for -T.\n", argv[0]);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                g_ctx.packet_threshold = tmp;
+                break;
+
+            case 't':
+                tmp = strtoull(optarg, NULL, 0);
+                if (!tmp || tmp > UINT8_MAX) {
+                    fprintf(stderr, "%s: invalid value for -t.\n", argv[0]);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                g_ctx.ttl = tmp;
+                break;
+
+            case 'v':
+                g_ctx.silent = 0;
+                break;
+
+            case 'z':
+                g_ctx.use_iptables = 1;
+                break;
+
+            case OPT_SEED:
+                tmp = strtoull(optarg, &endptr, 0);
+                if (!*optarg || *endptr) {
+                    fprintf(stderr, "%s: invalid value for --seed.\n",
+                            argv[0]);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                g_ctx.seed = tmp;
+                g_ctx.use_seed = 1;
+                break;
+
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!plinfo_cnt) {
+        plinfo[0].type = FH_PAYLOAD_HTTP;
+        plinfo[0].info = "www.example.com";
+    }
+    g_ctx.plinfo = plinfo;
+
+    if (!g_ctx.inbound && !g_ctx.outbound) {
+        g_ctx.inbound = g_ctx.outbound = 1;
+    }
+    g_ctx.use_ipv4 = g_ctx.use_ipv6 = 1;
+
+    res = fh_logger_setup();
+    if (res < 0) {
+        EE(T(fh_logger_setup));
+        return EXIT_FAILURE;
+    }
+
+    res = read_file(argv[optind], &in_buff, &in_len);
+    if (res < 0) {
+        EE(T(read_file));
+        goto cleanup_logger;
+    }
+
+    res = load_pcap(in_buff, in_len);
+    if (res < 0) {
+        EE(T(load_pcap));
+        goto free_mem;
+    }
+
+    if (local_str) {
+        res = parse_local(local_str, local, &local_family);
+        if (res < 0) {
+            fprintf(stderr, "%s: invalid value for -l.\n", argv[0]);
+            goto free_mem;
+        }
+    } else {
+        res = guess_local(local, &local_family);
+        if (res < 0) {
+            fprintf(stderr, "%s: no SYN in capture, please use -l.\n",
+                    argv[0]);
+            goto free_mem;
+        }
+    }
+
+    for (i = 0; i < pkts_cnt; i++) {
+        if (pkts[i].sll.sll_pkttype == PKTTYPE_UNKNOWN) {
+            set_direction(&pkts[i], local, local_family);
+        }
+    }
+
+    if (out_path) {
+        res = out_setup(out_path);
+        if (res < 0) {
+            EE(T(out_setup));
+            goto free_mem;
+        }
+    }
+
+    res = fh_prng_setup();
+    if (res < 0) {
+        EE(T(fh_prng_setup));
+        goto close_out;
+    }
+
+    fh_csum_setup();
+
+    res = fh_payload_setup();
+    if (res < 0) {
+        EE(T(fh_payload_setup));
+        goto close_out;
+    }
+
+    res = fh_conntrack_setup();
+    if (res < 0) {
+        EE(T(fh_conntrack_setup));
+        goto cleanup_payload;
+    }
+
+    /*
+        The handler may rewrite the packet (TFO option), so each run works on
+        a private copy. The copy is part of the measured time.
+    */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (l = 0; l < loops; l++) {
+        fh_conntrack_tick();
+        for (i = 0; i < pkts_cnt; i++) {
+            sll = pkts[i].sll;
+            memcpy(pkt_buff, pkts[i].data, pkts[i].len);
+
+            verdict = fh_rawsend_handle(&sll, pkt_buff, pkts[i].len, 0,
+                                        &modified);
+            if (verdict < 0) {
+                errors++;
+            } else if (verdict == NF_DROP) {
+                drops++;
+            } else {
+                accepts++;
+            }
+            if (modified) {
+                modified_cnt++;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    total = (double) pkts_cnt * loops;
+
+    fprintf(stderr,
+            "packets:   %zu x %llu\n"
+            "elapsed:   %.6f s\n"
+            "rate:      %.0f packets/s\n"
+            "latency:   %.1f ns/packet\n"
+            "verdicts:  ACCEPT %llu, DROP %llu, error %llu\n"
+            "modified:  %llu\n"
+            "generated: %llu packets, %llu bytes\n",
+            pkts_cnt, loops, elapsed, elapsed > 0 ? total / elapsed : 0.0,
+            total > 0 ? elapsed * 1e9 / total : 0.0, accepts, drops, errors,
+            modified_cnt, sent_pkts, sent_bytes);
+
+    exitcode = EXIT_SUCCESS;
+
+    fh_conntrack_cleanup();
+
+cleanup_payload:
+    fh_payload_cleanup();
+
+close_out:
+    if (out_fp) {
+        fclose(out_fp);
+    }
+
+free_mem:
+    free(pkts);
+    free(in_buff);
+
+cleanup_logger:
+    fh_logger_cleanup();
+
+    return exitcode;
+}